@@ -0,0 +1,451 @@
+#include "bench.h"
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "display.h"
+#include "flat_bus.h"
+#include "mmu.h"
+#include "pixels.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace Gameboy
+{
+    namespace Bench
+    {
+        namespace
+        {
+            // Far enough that no step is cut short
+            constexpr unsigned int no_event = 1u << 30;
+
+#if defined(GAMEBOY_DISPATCH_SWITCH)
+            constexpr const char *dispatch_mode = "switch";
+#else
+            constexpr const char *dispatch_mode = "table";
+#endif
+#if defined(GAMEBOY_LAZY_FLAGS)
+            constexpr const char *flags_mode = "lazy";
+#else
+            constexpr const char *flags_mode = "eager";
+#endif
+
+            // A few instructions timed as a loop of many copies. Every copy must leave the
+            // registers fit to run the next, and none may branch away or fuse.
+            struct Kernel {
+                const char *name;
+                std::vector<u8> code;
+            };
+
+            // A RET at 0x0008 for kernels that call, then SP, HL, DE and BC pointed into WRAM
+            // with room for pushes below SP
+            std::vector<u8> kernel_setup()
+            {
+                std::vector<u8> setup(0x10);
+                setup[0x00] = 0xC3;
+                setup[0x01] = 0x10;
+                setup[0x08] = 0xC9;
+                setup.insert(setup.end(), {0x31, 0x00, 0xD0, 0x21, 0x00, 0xC0, 0x11, 0x00, 0xC2,
+                                           0x01, 0x00, 0xC1});
+                return setup;
+            }
+
+            // Setup code at 0x0000, then body repeated and a jump back to the first copy
+            std::vector<u8> loop_program(const std::vector<u8> &setup, const std::vector<u8> &body,
+                                         unsigned int repeat)
+            {
+                std::vector<u8> program = setup;
+                u16 loop = (u16)program.size();
+                for (unsigned int i = 0; i < repeat; i++) {
+                    program.insert(program.end(), body.begin(), body.end());
+                }
+                program.insert(program.end(), {0xC3, (u8)loop, (u8)(loop >> 8)});
+                return program;
+            }
+
+            // Host ns per step once the decode cache is warm. Each step is one instruction as
+            // long as the code has no HALT and nothing that fuses.
+            template <typename Bus> double time_steps(CPU<Bus> &cpu, u64 steps)
+            {
+                for (u64 i = 0; i < steps / 16; i++) {
+                    cpu.step(no_event);
+                }
+                auto start = std::chrono::steady_clock::now();
+                for (u64 i = 0; i < steps; i++) {
+                    cpu.step(no_event);
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                return elapsed.count() / (double)steps;
+            }
+
+            double time_flat(const std::vector<u8> &program, u64 steps)
+            {
+                auto bus = std::make_unique<FlatBus>();
+                for (std::size_t i = 0; i < program.size(); i++) {
+                    bus->write((u16)i, program[i]);
+                }
+                Display display;
+                CPU<FlatBus> cpu(bus.get(), &display);
+                return time_steps(cpu, steps);
+            }
+
+            // Host ns per emulated cycle, stepping a line at a time like the scheduler so the
+            // JIT can run whole blocks
+            double time_cycles(CPU<MMU> &cpu, u64 cycles)
+            {
+                constexpr unsigned int line_cycles = 456;
+                for (u64 done = 0; done < cycles / 16;) {
+                    done += cpu.step(line_cycles);
+                }
+                u64 done = 0;
+                auto start = std::chrono::steady_clock::now();
+                while (done < cycles) {
+                    done += cpu.step(line_cycles);
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                return elapsed.count() / (double)done;
+            }
+
+            // The program is loaded as a ROM with no cartridge, scheduler or PPU
+            double time_mmu(const std::vector<u8> &program, u64 steps)
+            {
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(program.data(), program.size());
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+                return time_steps(cpu, steps);
+            }
+
+            // 512 banks of 16 KiB, each starting with its own number. Both reset and the
+            // cartridge entry point jump to the code at 0x0150.
+            std::vector<u8> banking_rom(const std::vector<u8> &code)
+            {
+                std::vector<u8> rom(512 * Cartridge::rom_bank_size);
+                for (std::size_t bank = 1; bank < 512; bank++) {
+                    rom[bank * Cartridge::rom_bank_size] = (u8)bank;
+                }
+                const u8 jump[] = {0xC3, 0x50, 0x01};
+                std::copy(jump, jump + 3, rom.begin());
+                std::copy(jump, jump + 3, rom.begin() + 0x101);
+                std::copy(code.begin(), code.end(), rom.begin() + 0x150);
+
+                const char title[] = "BANKING";
+                std::copy(title, title + sizeof(title) - 1, rom.begin() + 0x134);
+                rom[0x147] = 0x19; // MBC5
+                rom[0x148] = 0x08; // 8 MiB
+                u8 checksum = 0;
+                for (std::size_t address = 0x134; address <= 0x14C; address++) {
+                    checksum = checksum - rom[address] - 1;
+                }
+                rom[0x14D] = checksum;
+                return rom;
+            }
+
+            // Register loads, ALU, INC/DEC, rotates and reads through HL, nothing that
+            // branches, halts, writes memory or moves HL
+            std::vector<u8> mixed_body()
+            {
+                std::vector<u8> opcodes = {0x00, 0x03, 0x04, 0x05, 0x07, 0x0B, 0x0C, 0x0D,
+                                           0x0F, 0x13, 0x14, 0x15, 0x17, 0x1B, 0x1C, 0x1D,
+                                           0x1F, 0x27, 0x2F, 0x37, 0x3C, 0x3D, 0x3F};
+                for (u8 opcode = 0x40; opcode < 0x80; opcode++) {
+                    bool writes_hl = (opcode >= 0x60 && opcode < 0x78) || opcode == 0x76;
+                    if (!writes_hl) {
+                        opcodes.push_back(opcode);
+                    }
+                }
+                for (unsigned int opcode = 0x80; opcode < 0xC0; opcode++) {
+                    opcodes.push_back((u8)opcode);
+                }
+
+                std::mt19937 random(1);
+                std::vector<u8> body;
+                for (unsigned int i = 0; i < 256; i++) {
+                    body.push_back(opcodes[random() % opcodes.size()]);
+                }
+                return body;
+            }
+
+            // Best of a few runs, the rest is scheduling noise
+            template <typename Run> double best_of(unsigned int runs, Run &&run)
+            {
+                double best = run();
+                for (unsigned int i = 1; i < runs; i++) {
+                    best = std::min(best, run());
+                }
+                return best;
+            }
+
+            // check_interrupts() before IE & IF were cached: IME first, then both registers read
+            // through the bus and scanned bit by bit. Kept only to time against the cached mask.
+            int read_interrupts(MMU &memory, bool ime)
+            {
+                if (!ime) {
+                    return -1;
+                }
+                u8 interrupt_enable = memory.read(0xFFFF);
+                u8 interrupt_flag = memory.read(0xFF0F);
+                for (u8 i = 0; i <= 4; i++) {
+                    if (interrupt_enable >> i & interrupt_flag >> i & 1) {
+                        return i;
+                    }
+                }
+                return -1;
+            }
+
+            // check_interrupts() as it is now
+            int cached_interrupts(MMU &memory, bool ime)
+            {
+                u8 pending = memory.pending_interrupts();
+                if (!pending || !ime) {
+                    return -1;
+                }
+                return std::countr_zero(pending);
+            }
+
+            // Where time_check() leaves its results, so the checks are not optimized away
+            volatile int check_results = 0;
+
+            // Host ns per check. Each follows a WRAM store standing in for the instruction
+            // before it, so the bus reads cannot be hoisted out of the loop.
+            template <typename Check>
+            double time_check(MMU &memory, bool ime, Check &&check, u64 checks)
+            {
+                int taken = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (u64 i = 0; i < checks; i++) {
+                    memory.write((u16)(0xC000 + (i & 0xFF)), (u8)i);
+                    taken += check(memory, ime);
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                check_results = taken;
+                return elapsed.count() / (double)checks;
+            }
+
+            // JR NZ and JR C to the next instruction, so taken or not the loop goes on
+            const std::vector<Kernel> flag_kernels = {
+                {"add a,b", {0x80}},
+                {"adc a,b", {0x88}},
+                {"sub b", {0x90}},
+                {"sbc a,b", {0x98}},
+                {"and b", {0xA0}},
+                {"xor b", {0xA8}},
+                {"or b", {0xB0}},
+                {"cp b", {0xB8}},
+                {"inc b", {0x04}},
+                {"dec b", {0x05}},
+                {"add hl,bc", {0x09}},
+                {"rla", {0x17}},
+                {"rl b", {0xCB, 0x10}},
+                {"bit 0,b", {0xCB, 0x40}},
+                {"add a,b; jr nz", {0x80, 0x20, 0x00}},
+                {"sub b; jr c", {0x90, 0x38, 0x00}},
+                {"add a,b; adc a,c", {0x80, 0x89}},
+                {"add a,b; daa", {0x80, 0x27}},
+                {"add a,b; push af", {0x80, 0xF5, 0xF1}},
+            };
+
+            void time_kernels(const std::vector<Kernel> &kernels)
+            {
+                for (const Kernel &kernel : kernels) {
+                    auto program = loop_program(kernel_setup(), kernel.code, 64);
+                    double ns = best_of(5, [&] { return time_flat(program, 4000000); });
+                    std::printf("%-20s %6.2f ns per instruction\n", kernel.name, ns);
+                }
+            }
+        } // namespace
+
+        void dispatch()
+        {
+            // HL points at WRAM for the reads through it
+            auto program = loop_program({0x21, 0x00, 0xC0}, mixed_body(), 1);
+            double ns = best_of(5, [&] { return time_flat(program, 20000000); });
+            std::printf("%s dispatch: %.2f ns per instruction\n", dispatch_mode, ns);
+        }
+
+        void flags()
+        {
+            std::printf("%s flags\n", flags_mode);
+            time_kernels(flag_kernels);
+        }
+
+        void instructions()
+        {
+            std::printf("%s dispatch, %s flags\n", dispatch_mode, flags_mode);
+            time_kernels(flag_kernels);
+            // Every access stays in WRAM or HRAM and HL only moves on reads
+            time_kernels({
+                {"nop", {0x00}},
+                {"ld b,c", {0x41}},
+                {"ld a,n", {0x3E, 0x12}},
+                {"ld a,(hl)", {0x7E}},
+                {"ld (hl),a", {0x77}},
+                {"ld a,(hl+)", {0x2A}},
+                {"ld a,(bc)", {0x0A}},
+                {"ld (de),a", {0x12}},
+                {"ld a,(nn)", {0xFA, 0x00, 0xC0}},
+                {"ld (nn),a", {0xEA, 0x00, 0xC0}},
+                {"ldh a,(n)", {0xF0, 0x80}},
+                {"ldh (n),a", {0xE0, 0x80}},
+                {"inc (hl)", {0x34}},
+                {"ld bc,nn", {0x01, 0x00, 0xC1}},
+                {"inc bc", {0x03}},
+                {"dec de", {0x1B}},
+                {"add hl,de", {0x19}},
+                {"ld hl,sp+n", {0xF8, 0x01}},
+                {"push bc; pop bc", {0xC5, 0xC1}},
+                {"push af; pop af", {0xF5, 0xF1}},
+                {"jr", {0x18, 0x00}},
+                {"jr nz", {0x20, 0x00}},
+                {"call; ret", {0xCD, 0x08, 0x00}},
+                {"rst; ret", {0xCF}},
+            });
+        }
+
+        void interrupts()
+        {
+            struct Case {
+                const char *name;
+                std::vector<u8> setup;
+            };
+            // IME is set at reset. IE and IF are written before HL is pointed at WRAM.
+            const Case cases[] = {
+                {"ime off", {0xF3, 0x3E, 0x1F, 0xE0, 0xFF, 0x3E, 0x1F, 0xE0, 0x0F}},
+                {"ime on, none requested", {0x3E, 0x1F, 0xE0, 0xFF, 0xAF, 0xE0, 0x0F}},
+                {"ime on, all masked", {0xAF, 0xE0, 0xFF, 0x3E, 0x1F, 0xE0, 0x0F}},
+            };
+            auto body = mixed_body();
+            for (const Case &test : cases) {
+                auto setup = test.setup;
+                setup.insert(setup.end(), {0x21, 0x00, 0xC0});
+                auto program = loop_program(setup, body, 1);
+                double flat = best_of(5, [&] { return time_flat(program, 10000000); });
+                double mmu = best_of(5, [&] { return time_mmu(program, 10000000); });
+                std::printf("%-24s flat bus %6.2f  mmu %6.2f  ns per instruction\n", test.name,
+                            flat, mmu);
+            }
+
+            // The check alone on the MMU, reading IE and IF each time against the cached mask
+            struct Check {
+                const char *name;
+                bool ime;
+                u8 enable;
+                u8 flag;
+            };
+            const Check checks[] = {
+                {"ime off", false, 0x1F, 0x1F},
+                {"ime on, none requested", true, 0x1F, 0x00},
+                {"ime on, all masked", true, 0x00, 0x1F},
+            };
+            for (const Check &test : checks) {
+                auto memory = std::make_unique<MMU>();
+                memory->write(0xFFFF, test.enable);
+                memory->write(0xFF0F, test.flag);
+                double reads = best_of(5, [&] {
+                    return time_check(*memory, test.ime, read_interrupts, 50000000);
+                });
+                double cached = best_of(5, [&] {
+                    return time_check(*memory, test.ime, cached_interrupts, 50000000);
+                });
+                std::printf("%-24s two reads %6.2f  cached %6.2f  ns per check\n", test.name,
+                            reads, cached);
+            }
+        }
+
+        void banking()
+        {
+            // LD A,B; LD (nn),A; LD A,(0x4000); INC B; JR back, 52 cycles a time round
+            struct Case {
+                const char *name;
+                u16 store;
+            };
+            const Case cases[] = {{"bank switch", 0x2000}, {"wram store", 0xC000}};
+            constexpr double loop_cycles = 52;
+
+            auto path = std::filesystem::temp_directory_path() / "gameboy-bench-banking.gb";
+            for (const Case &test : cases) {
+                auto rom = banking_rom({0x78, 0xEA, (u8)test.store, (u8)(test.store >> 8), 0xFA,
+                                        0x00, 0x40, 0x04, 0x18, 0xF6});
+                std::FILE *file = std::fopen(path.string().c_str(), "wb");
+                if (!file || std::fwrite(rom.data(), 1, rom.size(), file) != rom.size()) {
+                    std::fprintf(stderr, "cannot write %s\n", path.string().c_str());
+                    if (file) {
+                        std::fclose(file);
+                    }
+                    return;
+                }
+                std::fclose(file);
+
+                double ns = best_of(5, [&] {
+                    Cartridge cartridge(path.string().c_str());
+                    auto memory = std::make_unique<MMU>();
+                    memory->load_cartridge(&cartridge);
+                    Display display;
+                    CPU<MMU> cpu(memory.get(), &display);
+#if defined(GAMEBOY_JIT)
+                    cpu.enable_jit();
+#endif
+                    return time_cycles(cpu, 100000000) * loop_cycles;
+                });
+                std::printf("%-12s %6.2f ns per loop\n", test.name, ns);
+            }
+            std::filesystem::remove(path);
+        }
+
+        void pixels()
+        {
+            constexpr std::size_t tiles = 384;
+            constexpr std::size_t pixel_count = tiles * 64;
+            constexpr int passes = 2000;
+            const std::array<u32, 4> colors = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+
+            std::vector<u8> data(tiles * 16);
+            u32 seed = 1;
+            for (u8 &byte : data) {
+                seed = seed * 1664525 + 1013904223;
+                byte = (u8)(seed >> 24);
+            }
+            std::vector<u8> indices(pixel_count);
+            std::vector<u8> shades(pixel_count);
+            std::vector<u32> rgba(pixel_count);
+
+            auto time = [&](auto &&kernel) {
+                auto start = std::chrono::steady_clock::now();
+                for (int pass = 0; pass < passes; pass++) {
+                    kernel(pass);
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                return (double)pixel_count * passes / elapsed.count();
+            };
+
+            auto initial = Pixels::selected();
+            for (int kernels = 0; kernels <= (int)Pixels::best(); kernels++) {
+                Pixels::select((Pixels::Kernels)kernels);
+                // The palette changes every pass so no call can be hoisted out of the loop
+                double decode = time(
+                    [&](int) { Pixels::decode_rows(data.data(), indices.data(), tiles * 8); });
+                double apply = time([&](int pass) {
+                    Pixels::apply_palette(indices.data(), shades.data(), pixel_count, (u8)pass);
+                });
+                double expand = time([&](int pass) {
+                    Pixels::expand_palette(indices.data(), rgba.data(), pixel_count, (u8)pass,
+                                           colors);
+                });
+                std::printf("%-8s decode %6.2f  palette %6.2f  rgba %6.2f  pixels/ns\n",
+                            Pixels::name((Pixels::Kernels)kernels), decode, apply, expand);
+            }
+            Pixels::select(initial);
+        }
+    } // namespace Bench
+} // namespace Gameboy
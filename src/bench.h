@@ -0,0 +1,28 @@
+#pragma once
+
+namespace Gameboy
+{
+    // Microbenchmarks run from the command line with --bench-<name>. Each runs without a ROM
+    // and prints host time per unit of emulated work, for comparing builds and commits.
+    namespace Bench
+    {
+        // Pixels per ns for each kernel set the host can run over a VRAM's worth of tiles
+        void pixels();
+        // ns per instruction over a fixed mix of ALU, load and register instructions, under
+        // whichever opcode dispatch the build uses
+        void dispatch();
+        // ns per instruction for each ALU operation that sets flags, alone and followed by
+        // something that reads them, with flags evaluated lazily or eagerly as built
+        void flags();
+        // ns per instruction for the flag kernels and the loads, 16-bit arithmetic, stack,
+        // memory and jump instructions
+        void instructions();
+        // ns per instruction with interrupts disabled, enabled with none requested and
+        // requested but masked off, on both FlatBus and the MMU, then ns per interrupt check
+        // alone with IE and IF read through the bus against the cached mask
+        void interrupts();
+        // ns per ROM bank switch on an 8 MiB MBC5 cartridge written to a temporary file and
+        // loaded like any other, against the same loop storing to WRAM instead
+        void banking();
+    } // namespace Bench
+} // namespace Gameboy
@@ -0,0 +1,209 @@
+#include "cartridge.h"
+
+#include "save_file.h"
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Gameboy
+{
+    namespace
+    {
+        struct CartridgeType {
+            u8 type;
+            Cartridge::Controller controller;
+            bool ram;
+            bool battery;
+            bool timer;
+        };
+
+        constexpr CartridgeType cartridge_types[] = {
+            {0x00, Cartridge::Controller::None, false, false, false},
+            {0x01, Cartridge::Controller::MBC1, false, false, false},
+            {0x02, Cartridge::Controller::MBC1, true, false, false},
+            {0x03, Cartridge::Controller::MBC1, true, true, false},
+            {0x05, Cartridge::Controller::MBC2, false, false, false},
+            {0x06, Cartridge::Controller::MBC2, false, true, false},
+            {0x08, Cartridge::Controller::None, true, false, false},
+            {0x09, Cartridge::Controller::None, true, true, false},
+            {0x0F, Cartridge::Controller::MBC3, false, true, true},
+            {0x10, Cartridge::Controller::MBC3, true, true, true},
+            {0x11, Cartridge::Controller::MBC3, false, false, false},
+            {0x12, Cartridge::Controller::MBC3, true, false, false},
+            {0x13, Cartridge::Controller::MBC3, true, true, false},
+            {0x19, Cartridge::Controller::MBC5, false, false, false},
+            {0x1A, Cartridge::Controller::MBC5, true, false, false},
+            {0x1B, Cartridge::Controller::MBC5, true, true, false},
+            {0x1C, Cartridge::Controller::MBC5, false, false, false},
+            {0x1D, Cartridge::Controller::MBC5, true, false, false},
+            {0x1E, Cartridge::Controller::MBC5, true, true, false},
+        };
+
+        // 8 KiB banks for each RAM size code, 0x01 being an unofficial 2 KiB part
+        constexpr u8 ram_banks[] = {0, 1, 1, 4, 16, 8};
+    } // namespace
+
+    Cartridge::Cartridge(const char *path)
+    {
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(
+            path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error(std::string("cannot open ") + path);
+        }
+        LARGE_INTEGER file_size;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &file_size)) {
+            size = (std::size_t)file_size.QuadPart;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        CloseHandle(file);
+        if (mapping) {
+            data = (const u8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        if (!data) {
+            throw std::runtime_error(std::string("cannot map ") + path);
+        }
+#else
+        int file = open(path, O_RDONLY);
+        if (file < 0) {
+            throw std::runtime_error(std::string("cannot open ") + path);
+        }
+        struct stat status;
+        void *mapping = MAP_FAILED;
+        if (fstat(file, &status) == 0 && status.st_size > 0) {
+            size = (std::size_t)status.st_size;
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        }
+        close(file);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error(std::string("cannot map ") + path);
+        }
+        data = (const u8 *)mapping;
+#endif
+
+        try {
+            parse_header();
+            open_ram(path);
+        } catch (...) {
+            unmap();
+            throw;
+        }
+    }
+
+    Cartridge::~Cartridge() { unmap(); }
+
+    void Cartridge::unmap()
+    {
+        if (!data) {
+            return;
+        }
+#if defined(_WIN32)
+        UnmapViewOfFile(data);
+#else
+        munmap((void *)data, size);
+#endif
+        data = nullptr;
+    }
+
+    void Cartridge::parse_header()
+    {
+        if (size < 0x150) {
+            throw std::runtime_error("ROM is too small to hold a cartridge header");
+        }
+
+        // The boot ROM refuses to start a cartridge whose header checksum is wrong
+        u8 checksum = 0;
+        for (std::size_t address = 0x134; address <= 0x14C; address++) {
+            checksum = checksum - data[address] - 1;
+        }
+        info.header_checksum = data[0x14D];
+        if (checksum != info.header_checksum) {
+            throw std::runtime_error("cartridge header checksum mismatch");
+        }
+        info.global_checksum = data[0x14E] << 8 | data[0x14F];
+
+        // Up to 16 characters, the last few of which newer cartridges use for other fields
+        for (std::size_t address = 0x134; address <= 0x143 && data[address]; address++) {
+            info.title += (char)data[address];
+        }
+
+        info.type = data[0x147];
+        const CartridgeType *type = nullptr;
+        for (const CartridgeType &candidate : cartridge_types) {
+            if (candidate.type == info.type) {
+                type = &candidate;
+            }
+        }
+        if (!type) {
+            throw std::runtime_error("unsupported cartridge type");
+        }
+        info.controller = type->controller;
+        info.ram = type->ram;
+        info.battery = type->battery;
+        info.timer = type->timer;
+
+        u8 rom_size = data[0x148];
+        if (rom_size > 0x08) {
+            throw std::runtime_error("invalid cartridge ROM size");
+        }
+        info.rom_banks = 2 << rom_size;
+        if (size < info.rom_banks * rom_bank_size) {
+            throw std::runtime_error("ROM file is smaller than its header declares");
+        }
+
+        u8 ram_size = data[0x149];
+        if (ram_size >= sizeof(ram_banks)) {
+            throw std::runtime_error("invalid cartridge RAM size");
+        }
+        // MBC2 has its RAM built in and declares none
+        info.ram_banks = info.ram ? ram_banks[ram_size] : 0;
+    }
+
+    void Cartridge::open_ram(const char *path)
+    {
+        ram_length = info.controller == Controller::MBC2 ? 512 : info.ram_banks * ram_bank_size;
+        std::size_t clock_size = info.timer ? RealTimeClock::state_size : 0;
+        if (!info.battery || ram_length + clock_size == 0) {
+            volatile_ram.resize(ram_length);
+            ram = volatile_ram.data();
+            return;
+        }
+
+        // The ROM's name with a .sav extension, the clock's state after the RAM
+        std::string save_path = path;
+        std::size_t extension = save_path.find_last_of("./\\");
+        if (extension != std::string::npos && save_path[extension] == '.') {
+            save_path.erase(extension);
+        }
+        save_path += ".sav";
+
+        save = std::make_unique<SaveFile>(save_path, ram_length + clock_size);
+        ram = save->data();
+        if (info.timer) {
+            rtc.load(ram + ram_length);
+            rtc.persist(ram + ram_length);
+        }
+    }
+
+    bool Cartridge::verify_global_checksum() const
+    {
+        u16 sum = 0;
+        for (std::size_t address = 0; address < info.rom_banks * rom_bank_size; address++) {
+            if (address != 0x14E && address != 0x14F) {
+                sum += data[address];
+            }
+        }
+        return sum == info.global_checksum;
+    }
+} // namespace Gameboy
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "rtc.h"
+#include "types.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Gameboy
+{
+    class SaveFile;
+
+    // A ROM file mapped read-only, with the cartridge's RAM and clock. Banks are pointers into
+    // the mapping, so nothing is copied and instances running the same ROM share its pages.
+    // Battery-backed RAM and the clock live in a .sav file next to the ROM.
+    // Throws std::runtime_error if the file cannot be mapped or its header is invalid.
+    class Cartridge
+    {
+      public:
+        enum class Controller : u8 { None, MBC1, MBC2, MBC3, MBC5 };
+
+        struct Header {
+            std::string title;
+            u8 type;
+            Controller controller;
+            bool ram;
+            bool battery;
+            bool timer;
+            u16 rom_banks;
+            u8 ram_banks;
+            u8 header_checksum;
+            u16 global_checksum;
+        };
+
+        static constexpr std::size_t rom_bank_size = 0x4000;
+        static constexpr std::size_t ram_bank_size = 0x2000;
+
+        explicit Cartridge(const char *path);
+        ~Cartridge();
+        Cartridge(const Cartridge &) = delete;
+        Cartridge &operator=(const Cartridge &) = delete;
+
+        const Header &header() const { return info; }
+
+        // Bank numbers wrap at the ROM size like the address lines of a real cartridge
+        const u8 *rom_bank(u16 bank) const
+        {
+            return data + (bank % info.rom_banks) * rom_bank_size;
+        }
+
+        // RAM banks wrap the same way. MBC2 has 512 half-bytes built in and no banks.
+        u8 *ram_bank(u8 bank) { return ram + (bank % info.ram_banks) * ram_bank_size; }
+        u8 *ram_data() { return ram; }
+        std::size_t ram_size() const { return ram_length; }
+
+        RealTimeClock &clock() { return rtc; }
+
+        // Reads the whole ROM, so it is left to the caller rather than done on load
+        bool verify_global_checksum() const;
+
+      private:
+        void parse_header();
+        void open_ram(const char *path);
+        void unmap();
+
+      private:
+        const u8 *data = nullptr;
+        std::size_t size = 0;
+        Header info = {};
+        u8 *ram = nullptr;
+        std::size_t ram_length = 0;
+        std::vector<u8> volatile_ram;
+        std::unique_ptr<SaveFile> save;
+        RealTimeClock rtc;
+    };
+} // namespace Gameboy
\ No newline at end of file
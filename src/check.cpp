@@ -0,0 +1,630 @@
+#include "check.h"
+
+#include "cpu.h"
+#include "display.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "save_file.h"
+#include "scheduler.h"
+#include "trap.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace Gameboy
+{
+    namespace Check
+    {
+        namespace
+        {
+            bool expect(bool condition, const char *what)
+            {
+                if (!condition) {
+                    std::fprintf(stderr, "check failed: %s\n", what);
+                }
+                return condition;
+            }
+
+            std::vector<u8> read_file(const std::filesystem::path &path)
+            {
+                std::vector<u8> data;
+                std::FILE *file = std::fopen(path.string().c_str(), "rb");
+                if (!file) {
+                    return data;
+                }
+                u8 buffer[4096];
+                std::size_t read;
+                while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+                    data.insert(data.end(), buffer, buffer + read);
+                }
+                std::fclose(file);
+                return data;
+            }
+
+            // Stands in for the CPU to move the scheduler's clock
+            struct Idle {
+                unsigned int step(unsigned int cycles) { return cycles; }
+            };
+
+            bool check_dma_timing()
+            {
+                auto memory = std::make_unique<MMU>();
+                Scheduler scheduler;
+                memory->set_scheduler(&scheduler);
+                Idle idle;
+                for (u8 i = 0; i < 0xA0; i++) {
+                    memory->write(0xC000 + i, i ^ 0x5A);
+                    memory->write(0xFE00 + i, 0);
+                }
+
+                memory->write(0xFF46, 0xC0);
+                bool ok = expect(memory->read(0xC000) == 0xFF, "WRAM reads 0xFF during DMA");
+                ok &= expect(memory->read(0x0000) == 0xFF, "ROM reads 0xFF during DMA");
+                memory->write(0xC000, 0x99);
+                memory->write(0xFF80, 0x12);
+                ok &= expect(memory->read(0xFF80) == 0x12, "HRAM works during DMA");
+
+                // A byte every 4 cycles, OAM only sees what has been copied so far
+                scheduler.run(idle, 40);
+                const u8 *oam = memory->object_attributes();
+                ok &= expect(oam[9] == (9 ^ 0x5A) && oam[10] == 0, "10 bytes copied at 40 cycles");
+                scheduler.run(idle, 639);
+                ok &= expect(memory->read(0xC000) == 0xFF, "bus still locked at 639 cycles");
+                scheduler.run(idle, 640);
+                ok &= expect(memory->read(0xC000) == 0x5A,
+                             "bus released at 640 cycles, with the locked write dropped");
+                oam = memory->object_attributes();
+                ok &= expect(oam[0x9F] == (0x9F ^ 0x5A), "all 160 bytes copied");
+                return ok;
+            }
+
+            // Runs a ROM with code preloaded into HRAM for long enough that any DMA it starts
+            // ends, and returns what it stored at 0xC100
+            u8 run_dma_program(const std::vector<u8> &rom, const std::vector<u8> &hram)
+            {
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(rom.data(), rom.size());
+                for (std::size_t i = 0; i < hram.size(); i++) {
+                    memory->write((u16)(0xFF80 + i), hram[i]);
+                }
+                Scheduler scheduler;
+                memory->set_scheduler(&scheduler);
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+#if defined(GAMEBOY_JIT)
+                cpu.enable_jit();
+#endif
+                scheduler.run(cpu, 10000);
+                return memory->read(0xC100);
+            }
+
+            // Code in ROM starts a DMA. Its next fetch, like any outside HRAM, reads 0xFF: RST 38
+            // over and over with the stack in HRAM, and never the LD B decoded along with it. Once
+            // the bus is released 0x38 must decode as the JP it holds, to code storing B.
+            bool check_dma_decode()
+            {
+                std::vector<u8> rom(0x8000);
+                const u8 start[] = {0x31, 0xFE, 0xFF, 0x06, 0x42, 0x3E, 0xC0,
+                                    0xE0, 0x46, 0x06, 0x99, 0xC3, 0x60, 0x01};
+                const u8 handler[] = {0xC3, 0x60, 0x01};
+                const u8 released[] = {0x78, 0xEA, 0x00, 0xC1, 0x18, 0xFE};
+                std::copy(start, start + sizeof(start), rom.begin());
+                std::copy(handler, handler + sizeof(handler), rom.begin() + 0x38);
+                std::copy(released, released + sizeof(released), rom.begin() + 0x160);
+
+                u8 stored = run_dma_program(rom, {});
+                bool ok = expect(stored != 0x99, "the instruction after starting a DMA reads 0xFF");
+                return ok & expect(stored == 0x42, "code runs from ROM once the DMA ends");
+            }
+
+            // INC B; RET at 0x0150 called 20 times, enough for the JIT to compile it, then once
+            // more by an HRAM routine that starts a DMA. That call must read 0xFF like any fetch
+            // outside HRAM, not run the cached block, so B is still 20 once the bus is released.
+            bool check_dma_cached()
+            {
+                std::vector<u8> rom(0x8000);
+                const u8 start[] = {0x31, 0xFE, 0xFF, 0x0E, 0x14, 0xCD, 0x50,
+                                    0x01, 0x0D, 0x20, 0xFA, 0xC3, 0x80, 0xFF};
+                const u8 handler[] = {0xC3, 0x60, 0x01};
+                const u8 routine[] = {0x04, 0xC9};
+                const u8 released[] = {0x78, 0xEA, 0x00, 0xC1, 0x18, 0xFE};
+                std::copy(start, start + sizeof(start), rom.begin());
+                std::copy(handler, handler + sizeof(handler), rom.begin() + 0x38);
+                std::copy(routine, routine + sizeof(routine), rom.begin() + 0x150);
+                std::copy(released, released + sizeof(released), rom.begin() + 0x160);
+
+                u8 stored = run_dma_program(rom, {0x3E, 0xC0, 0xE0, 0x46, 0xC3, 0x50, 0x01});
+                return expect(stored == 20, "a block cached before a DMA reads 0xFF during it");
+            }
+
+            // Passes the CPU too little time for a whole iteration, so polling loops are never
+            // skipped, as if built without GAMEBOY_IDLE_SKIP
+            struct Unskipped {
+                CPU<MMU> &cpu;
+                unsigned int step(unsigned int cycles) { return cpu.step(std::min(cycles, 4u)); }
+            };
+
+            // Where the first breakpoint hit stopped the run
+            struct Stop {
+                Scheduler &scheduler;
+                MMU &memory;
+                u64 timestamp = 0;
+                u8 line = 0;
+            };
+
+            void stop_at_trap(void *context, const Trap &)
+            {
+                auto &stop = *static_cast<Stop *>(context);
+                stop.timestamp = stop.scheduler.now();
+                stop.line = stop.memory.read(0xFF44);
+                stop.scheduler.stop();
+            }
+
+            void record_trap(void *context, const Trap &trap)
+            {
+                static_cast<std::vector<Trap> *>(context)->push_back(trap);
+            }
+
+            bool same_trap(const Trap &trap, Trap::Kind kind, u16 address, u8 value)
+            {
+                return trap.kind == kind && trap.address == address && trap.value == value;
+            }
+
+            // INC A; LD (C000),A; JP 0100, run long enough to be compiled when the JIT is on,
+            // then with a breakpoint on the store and after it is cleared
+            bool check_breakpoints(bool compiled)
+            {
+                std::vector<u8> rom(0x8000);
+                const u8 start[] = {0xC3, 0x00, 0x01};
+                const u8 loop[] = {0x3C, 0xEA, 0x00, 0xC0, 0xC3, 0x00, 0x01};
+                std::copy(start, start + sizeof(start), rom.begin());
+                std::copy(loop, loop + sizeof(loop), rom.begin() + 0x100);
+
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(rom.data(), rom.size());
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+#if defined(GAMEBOY_JIT)
+                if (compiled) {
+                    cpu.enable_jit();
+                }
+#else
+                (void)compiled;
+#endif
+                for (int i = 0; i < 100; i++) {
+                    cpu.step(4);
+                }
+
+                std::vector<Trap> traps;
+                cpu.set_trap_handler(record_trap, &traps);
+                cpu.set_breakpoint(0x0101);
+                bool ok = true;
+                for (std::size_t round = 1; round <= 3; round++) {
+                    unsigned int cycles = 1;
+                    for (int i = 0; i < 10 && traps.size() < round; i++) {
+                        cycles = cpu.step(4);
+                    }
+                    ok &= expect(traps.size() == round, "one hit each time round the loop");
+                    ok &= expect(cycles == 0, "the step that hits runs nothing");
+
+                    // INC A has run, the store it stopped in front of runs on the next step
+                    u8 stored = memory->read(0xC000);
+                    ok &= expect(cpu.step(4) > 0, "the step after a hit runs the instruction");
+                    ok &= expect(memory->read(0xC000) == (u8)(stored + 1), "the store ran once");
+                    ok &= expect(traps.size() == round, "no second hit for the held instruction");
+                }
+                if (traps.size() == 3) {
+                    ok &= expect(same_trap(traps[2], Trap::Kind::Execute, 0x0101, 0xEA),
+                                 "breakpoint reports its address and opcode");
+                }
+
+                cpu.clear_breakpoint(0x0101);
+                u8 stored = memory->read(0xC000);
+                for (int i = 0; i < 100; i++) {
+                    cpu.step(4);
+                }
+                ok &= expect(traps.size() == 3, "no hits after the breakpoint is cleared");
+                return ok & expect(memory->read(0xC000) != stored, "the loop runs on once cleared");
+            }
+
+            // Straight-line code that keeps HL in work RAM and SP where it was, so any mix of it
+            // can be looped: loads, ALU, rotates, CB operations, WRAM and HRAM accesses,
+            // balanced pushes and pops, and conditional jumps over the instruction that follows
+            std::vector<u8> random_code(std::mt19937 &random, std::size_t instructions)
+            {
+                auto any = [&](unsigned int count) { return (u8)(random() % count); };
+                auto instruction = [&]() -> std::vector<u8> {
+                    static const u8 registers[] = {0, 1, 2, 3, 7};
+                    u8 r = registers[any(5)];
+                    switch (any(14)) {
+                        case 0: return {(u8)(0x80 + any(0x40))};
+                        case 1: return {(u8)(0xC6 + any(8) * 8), any(256)};
+                        case 2: return {(u8)(0x40 + r * 8 + any(8))};
+                        case 3: return {(u8)(0x70 + registers[any(5)])};
+                        case 4: return {(u8)(0x06 + r * 8), any(256)};
+                        case 5: return {(u8)(0x04 + r * 8 + any(2))};
+                        case 6: return {(u8)(0x03 + any(2) * 16 + any(2) * 8)};
+                        case 7: return {(u8)(0x07 + any(8) * 8)};
+                        case 8: return {0xCB, any(256)};
+                        case 9: return {(u8)(0x22 + any(4) * 8)};
+                        case 10:
+                            return {(u8)(any(2) ? 0xEA : 0xFA), any(256), (u8)(0xC0 + any(16))};
+                        case 11: return {(u8)(any(2) ? 0xE0 : 0xF0), (u8)(0x80 + any(0x7F))};
+                        case 12: {
+                            static const u8 pops[] = {0xC1, 0xD1, 0xF1};
+                            return {(u8)(0xC5 + any(4) * 16), pops[any(3)]};
+                        }
+                        default:
+                            return any(2) ? std::vector<u8>{0x36, any(256)}
+                                          : std::vector<u8>{(u8)(0x34 + any(2))};
+                    }
+                };
+
+                std::vector<u8> code;
+                for (std::size_t i = 0; i < instructions; i++) {
+                    auto next = instruction();
+                    if (any(8) == 0) {
+                        code.insert(code.end(), {(u8)(0x20 + any(4) * 8), (u8)next.size()});
+                    }
+                    code.insert(code.end(), next.begin(), next.end());
+                }
+                return code;
+            }
+
+            u8 pattern(std::size_t offset, u8 seed) { return (u8)(offset * 7 + seed); }
+
+#if !defined(_WIN32)
+            // The child maps the file, writes the pattern and dies by signal without returning
+            // or unmapping, long before the flush thread's first msync
+            bool crash_after_write(const std::filesystem::path &path, std::size_t size, u8 seed,
+                                   int signal)
+            {
+                std::fflush(nullptr);
+                pid_t child = fork();
+                if (child < 0) {
+                    return expect(false, "fork");
+                }
+                if (child == 0) {
+                    SaveFile save(path.string(), size);
+                    for (std::size_t i = 0; i < size; i++) {
+                        save.data()[i] = pattern(i, seed);
+                    }
+                    if (signal == SIGABRT) {
+                        std::abort();
+                    }
+                    std::raise(signal);
+                    std::_Exit(0);
+                }
+
+                int status = 0;
+                bool ok = expect(waitpid(child, &status, 0) == child, "waitpid");
+                ok &= expect(WIFSIGNALED(status) && WTERMSIG(status) == signal,
+                             "child killed by the expected signal");
+
+                auto data = read_file(path);
+                ok &= expect(data.size() == size, ".sav file has the mapped size");
+                bool intact = data.size() == size;
+                for (std::size_t i = 0; intact && i < size; i++) {
+                    intact = data[i] == pattern(i, seed);
+                }
+                return ok & expect(intact, ".sav file holds every byte written before the kill");
+            }
+#endif
+        } // namespace
+
+        bool save_file()
+        {
+#if defined(_WIN32)
+            std::fprintf(stderr, "save file check needs fork, skipped\n");
+            return true;
+#else
+            // 32 KiB of RAM and a clock, so the file spans several pages
+            constexpr std::size_t size = 0x8000 + 48;
+            auto path = std::filesystem::temp_directory_path() / "gameboy-check-save.sav";
+            std::filesystem::remove(path);
+
+            // Created by a child that is killed, then rewritten over by one that aborts
+            bool ok = crash_after_write(path, size, 3, SIGKILL);
+            ok &= crash_after_write(path, size, 101, SIGABRT);
+
+            // A clean reopen sees the last pattern and does not grow the file
+            {
+                SaveFile save(path.string(), size);
+                ok &= expect(!save.extended(), "reopened .sav file is not extended");
+                ok &= expect(save.data()[size - 1] == pattern(size - 1, 101),
+                             "reopened mapping holds the written data");
+            }
+            std::filesystem::remove(path);
+            if (ok) {
+                std::printf("save file: ok\n");
+            }
+            return ok;
+#endif
+        }
+
+        bool dma()
+        {
+            bool ok = check_dma_timing();
+            ok &= check_dma_decode();
+            ok &= check_dma_cached();
+            if (ok) {
+                std::printf("dma: ok\n");
+            }
+            return ok;
+        }
+
+        bool fusion()
+        {
+            // Every superinstruction, a fill and a copy that overwrite their own loop and random
+            // code storing all over work RAM, run from 0xD800 and ending with the registers
+            // pushed and a jump to a breakpoint
+            constexpr u16 origin = 0xD800;
+            std::vector<u8> code;
+            auto here = [&]() { return (u16)(origin + code.size()); };
+            auto add = [&](std::initializer_list<u8> bytes) { code.insert(code.end(), bytes); };
+            auto ld_hl = [&](u16 address) { add({0x21, (u8)address, (u8)(address >> 8)}); };
+            auto ld_de = [&](u16 address) { add({0x11, (u8)address, (u8)(address >> 8)}); };
+
+            ld_hl(0xC800);
+            ld_de(0xC900);
+            add({0x0E, 0x40, 0x2A, 0x12, 0x13, 0x0D, 0x20, 0xFA});
+            ld_hl(0xC800);
+            ld_de(0xCA00);
+            add({0x0E, 0x20, 0x2A, 0x12, 0x0D, 0x20, 0xFB});
+            ld_hl(0xC810);
+            ld_de(0xCA40);
+            add({0x06, 0x30, 0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA});
+            ld_hl(0xCB00);
+            add({0x3E, 0x5A, 0x06, 0x80, 0x22, 0x05, 0x20, 0xFC});
+            add({0x0E, 0x10, 0x22, 0x0D, 0x20, 0xFC});
+            ld_hl(0xCC00);
+            add({0xAF, 0x22, 0xAF, 0x22, 0xAF, 0x22});
+            add({0x3E, 0x00, 0x3C, 0xFE, 0x30, 0x20, 0xFB});
+            add({0xFE, 0x10, 0x38, 0x01, 0x3C, 0xFE, 0x10, 0x30, 0x01, 0x3C});
+            add({0xFE, 0x32, 0x28, 0x01, 0x3C});
+
+            // LD (HL+),A stores a NOP over itself, the rest of the loop still runs to B = 0
+            ld_hl(here() + 6);
+            add({0xAF, 0x06, 0x08, 0x22, 0x05, 0x20, 0xFC});
+            // The copy stores zeroes over its own LD A,(HL+) and then LD (DE),A, and counts C
+            // down with nothing left to store
+            ld_hl(0xCD00);
+            ld_de(here() + 5);
+            add({0x0E, 0x10, 0x2A, 0x12, 0x13, 0x0D, 0x20, 0xFA});
+            // The first store turns the copy's DEC C into DEC B, which has to run straight away.
+            // C is kept out of the way of the random code.
+            ld_hl(0xCE00);
+            ld_de(here() + 9);
+            add({0x06, 0x03, 0x0E, 0x40, 0x2A, 0x12, 0x0D, 0x20, 0xFB, 0x79, 0xEA, 0x00, 0xDF});
+            // A copy over the decoded NOPs after it, which then run as INC B
+            ld_hl(0xCE10);
+            ld_de(here() + 13);
+            add({0x06, 0x00, 0x0E, 0x08, 0x2A, 0x12, 0x13, 0x0D, 0x20, 0xFA});
+            add({0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0xEA, 0x01, 0xDF});
+
+            std::mt19937 random(7);
+            ld_hl(0xC400);
+            auto mixed = random_code(random, 300);
+            code.insert(code.end(), mixed.begin(), mixed.end());
+            u16 end = here() + 7;
+            add({0xF5, 0xC5, 0xD5, 0xE5, 0xC3, (u8)end, (u8)(end >> 8), 0x18, 0xFE});
+
+            struct Result {
+                u64 timestamp;
+                u64 hash;
+                CPU<MMU>::FusionStats fusions;
+            };
+            auto run = [&](bool fusion) {
+                const u8 start[] = {0x31, 0xF0, 0xDF, 0xC3, (u8)origin, (u8)(origin >> 8)};
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(start, sizeof(start));
+                for (u16 i = 0; i < 0x100; i++) {
+                    memory->write(0xC800 + i, (u8)(i * 13 + 1));
+                }
+                // DEC B and INC B for the copies over code
+                for (u16 i = 0; i < 0x10; i++) {
+                    memory->write(0xCE00 + i, 0x05);
+                    memory->write(0xCE10 + i, 0x04);
+                }
+                for (std::size_t i = 0; i < code.size(); i++) {
+                    memory->write((u16)(origin + i), code[i]);
+                }
+                Scheduler scheduler;
+                memory->set_scheduler(&scheduler);
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+                cpu.set_fusion(fusion);
+                Stop stop = {scheduler, *memory};
+                cpu.set_trap_handler(stop_at_trap, &stop);
+                cpu.set_breakpoint(end);
+                scheduler.run(cpu, 1000000);
+
+                // Work RAM and HRAM, with the registers pushed at the end
+                u64 hash = 0xCBF29CE484222325;
+                for (u32 address = 0xC000; address < 0xFFFF; address++) {
+                    if (address < 0xE000 || address >= 0xFF80) {
+                        hash = (hash ^ memory->read((u16)address)) * 0x100000001B3;
+                    }
+                }
+                return Result{stop.timestamp, hash, cpu.fusion_stats()};
+            };
+
+            Result fused = run(true);
+            Result plain = run(false);
+            bool ok = expect(plain.timestamp > 0, "program reached its end");
+            ok &= expect(fused.timestamp == plain.timestamp, "same cycle with fusion");
+            ok &= expect(fused.hash == plain.hash, "same work RAM and registers with fusion");
+            for (u64 count : plain.fusions) {
+                ok &= expect(count == 0, "nothing fused with fusion off");
+            }
+#if !defined(GAMEBOY_DISPATCH_SWITCH) && !defined(GAMEBOY_HEATMAP)
+            // Built without superinstructions both runs are the same anyway
+            for (u64 count : fused.fusions) {
+                ok &= expect(count > 0, "every superinstruction ran");
+            }
+#endif
+            if (ok) {
+                std::printf("fusion: ok\n");
+            }
+            return ok;
+        }
+
+        bool idle_skip()
+        {
+            // Turns the LCD on, waits for VBlank with LDH A,(44h); CP 90h; JR NZ and jumps to a
+            // breakpoint, kept out of the loop's block as it would stop the loop being marked
+            auto wait_for_vblank = [](bool skip, u64 &skipped) {
+                std::vector<u8> rom(0x8000);
+                const u8 start[] = {0x3E, 0x91, 0xE0, 0x40, 0xC3, 0x00, 0x01};
+                const u8 loop[] = {0xF0, 0x44, 0xFE, 0x90, 0x20, 0xFA, 0xC3, 0x00, 0x02};
+                std::copy(start, start + sizeof(start), rom.begin());
+                std::copy(loop, loop + sizeof(loop), rom.begin() + 0x100);
+                rom[0x200] = 0x18;
+                rom[0x201] = 0xFE;
+
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(rom.data(), rom.size());
+                Scheduler scheduler;
+                memory->set_scheduler(&scheduler);
+                PPU ppu(memory.get(), &scheduler, PPU::Renderer::Scanline);
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+#if defined(GAMEBOY_JIT)
+                cpu.enable_jit();
+#endif
+                Stop stop = {scheduler, *memory};
+                cpu.set_trap_handler(stop_at_trap, &stop);
+                cpu.set_breakpoint(0x200);
+                if (skip) {
+                    scheduler.run(cpu, 100000);
+                } else {
+                    Unskipped unskipped = {cpu};
+                    scheduler.run(unskipped, 100000);
+                }
+#if defined(GAMEBOY_IDLE_SKIP)
+                skipped = cpu.idle_cycles_skipped();
+#else
+                skipped = 0;
+#endif
+                return stop;
+            };
+
+            u64 skipped = 0, unskipped = 0;
+            Stop fast = wait_for_vblank(true, skipped);
+            Stop slow = wait_for_vblank(false, unskipped);
+            bool ok = expect(slow.line == 0x90 && slow.timestamp > 0, "loop left at LY 90h");
+            ok &= expect(fast.line == slow.line, "same LY with polling loops skipped");
+            ok &= expect(fast.timestamp == slow.timestamp,
+                         "same cycle with polling loops skipped");
+            ok &= expect(unskipped == 0, "nothing skipped with short steps");
+#if defined(GAMEBOY_IDLE_SKIP)
+            ok &= expect(skipped > 0, "the loop was skipped");
+#endif
+            if (ok) {
+                std::printf("idle skip: ok\n");
+            }
+            return ok;
+        }
+
+        bool watchpoints()
+        {
+            // SCX written and HRAM read through LDH and through full addresses, then a write to
+            // an unwatched byte next to the watched one
+            const u8 program[] = {0x3E, 0x07, 0xE0, 0x42, 0xEA, 0x42, 0xFF, 0xF0, 0x80,
+                                  0xFA, 0x80, 0xFF, 0xE0, 0x81, 0x18, 0xFE};
+            auto memory = std::make_unique<MMU>();
+            memory->load_rom(program, sizeof(program));
+            memory->write(0xFF80, 0x33);
+            std::vector<Trap> traps;
+            memory->set_trap_handler(record_trap, &traps);
+            memory->set_watchpoint(0xFF42, Trap::Kind::Write);
+            memory->set_watchpoint(0xFF80, Trap::Kind::Read);
+            Display display;
+            CPU<MMU> cpu(memory.get(), &display);
+            for (int i = 0; i < 7; i++) {
+                cpu.step(1000);
+            }
+
+            bool ok = expect(traps.size() == 4, "one report per watched access");
+            if (traps.size() == 4) {
+                ok &= expect(same_trap(traps[0], Trap::Kind::Write, 0xFF42, 0x07), "LDH write");
+                ok &= expect(same_trap(traps[1], Trap::Kind::Write, 0xFF42, 0x07), "LD write");
+                ok &= expect(same_trap(traps[2], Trap::Kind::Read, 0xFF80, 0x33), "LDH read");
+                ok &= expect(same_trap(traps[3], Trap::Kind::Read, 0xFF80, 0x33), "LD read");
+            }
+
+            ok &= check_breakpoints(false);
+#if defined(GAMEBOY_JIT)
+            ok &= check_breakpoints(true);
+#endif
+            if (ok) {
+                std::printf("watchpoints: ok\n");
+            }
+            return ok;
+        }
+
+#if defined(GAMEBOY_JIT)
+        bool jit_lockstep()
+        {
+            // Reset sets SP in work RAM and jumps to the loop at 0x0100
+            auto mismatches = [](const std::vector<u8> &loop, const std::vector<u8> &vblank) {
+                std::vector<u8> rom(0x8000);
+                const u8 start[] = {0x31, 0xF0, 0xDF, 0xC3, 0x00, 0x01};
+                std::copy(start, start + sizeof(start), rom.begin());
+                std::copy(vblank.begin(), vblank.end(), rom.begin() + 0x40);
+                std::copy(loop.begin(), loop.end(), rom.begin() + 0x100);
+
+                auto memory = std::make_unique<MMU>();
+                memory->load_rom(rom.data(), rom.size());
+                Display display;
+                CPU<MMU> cpu(memory.get(), &display);
+                cpu.enable_jit(true);
+                for (int i = 0; i < 100000; i++) {
+                    cpu.step(456);
+                }
+                return cpu.lockstep_mismatches();
+            };
+
+            // A compiled loop requesting VBlank with IE and IME set has to be left for the
+            // interrupt right after the write, not at the end of its cycle budget
+            bool ok = true;
+            std::vector<u8> requests = {0x3E, 0x01, 0xE0, 0xFF, 0x3E, 0x01, 0xE0, 0x0F,
+                                        0x04, 0x0C, 0x1C, 0xC3, 0x04, 0x01};
+            if (u64 count = mismatches(requests, {0x14, 0xD9})) {
+                std::fprintf(stderr, "interrupt request: %llu lockstep mismatches\n",
+                             (unsigned long long)count);
+                ok = false;
+            }
+
+            for (u32 seed = 1; seed <= 8; seed++) {
+                // Each pass starts by pointing HL at work RAM
+                std::mt19937 random(seed);
+                std::vector<u8> loop = {0x21, 0x00, 0xC4};
+                auto code = random_code(random, 400);
+                loop.insert(loop.end(), code.begin(), code.end());
+                loop.insert(loop.end(), {0xC3, 0x00, 0x01});
+                if (u64 count = mismatches(loop, {})) {
+                    std::fprintf(stderr, "seed %u: %llu lockstep mismatches\n", seed,
+                                 (unsigned long long)count);
+                    ok = false;
+                }
+            }
+            if (ok) {
+                std::printf("jit lockstep: ok\n");
+            }
+            return ok;
+        }
+#endif
+    } // namespace Check
+} // namespace Gameboy
@@ -0,0 +1,31 @@
+#pragma once
+
+namespace Gameboy
+{
+    // Self-checks run from the command line with --check-<name> and registered with CTest.
+    // Each prints what failed to stderr and returns whether everything passed.
+    namespace Check
+    {
+        // Kills a child process right after it writes through a SaveFile, before any flush,
+        // and checks the .sav file holds every byte it wrote
+        bool save_file();
+        // OAM DMA timing and bus lockout, code outside HRAM fetching 0xFF while the bus is
+        // locked whether or not it was decoded before, and running from the real bytes once
+        // it is released
+        bool dma();
+        // Code run with superinstructions ends on the same cycle with the same memory and
+        // registers as without, including code that overwrites its own fused loops
+        bool fusion();
+        // A polling loop waiting on LY leaves at the same cycle whether or not it is skipped
+        bool idle_skip();
+        // Watchpoints in page 0xFF report once per access, through LDH and full addresses.
+        // Breakpoints report once each time round, holding PC for one step, interpreted and
+        // compiled, and stop when cleared.
+        bool watchpoints();
+#if defined(GAMEBOY_JIT)
+        // A random ROM program run by the JIT in lockstep with the interpreter, which must
+        // agree on every register after every step
+        bool jit_lockstep();
+#endif
+    } // namespace Check
+} // namespace Gameboy
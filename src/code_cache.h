@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+
+namespace Gameboy
+{
+    // The part of the decode cache a bus notifies about writes to code, whatever its type
+    class CodeCache
+    {
+      public:
+        virtual ~CodeCache() = default;
+        virtual void invalidate_page(u8 page) = 0;
+        // The ROM bank at 0x4000-0x7FFF changed
+        virtual void switch_bank() = 0;
+        // OAM DMA started, until it ends the CPU fetches 0xFF outside page 0xFF
+        virtual void lock_bus() = 0;
+    };
+} // namespace Gameboy
@@ -1,7 +1,15 @@
 #include "cpu.h"
 
+#include "decode_cache.h"
 #include "display.h"
+#include "flat_bus.h"
+#include "jit.h"
 #include "mmu.h"
+#include "tracing_bus.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
 
 #define A af.hi()
 #define F af.lo()
@@ -31,40 +39,225 @@
 
 #define FLAG_SET(value, n) (value & 1 << n)
 
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
 namespace Gameboy
 {
-    CPU::CPU(MMU *memory, Display *display) : memory(memory), display(display) {}
+    template <typename Bus>
+    CPU<Bus>::CPU(Bus *memory, Display *display)
+        : memory(memory), display(display), decode_cache(new DecodeCache<Bus>(this, memory))
+    {
+        memory->set_decode_cache(decode_cache.get());
+    }
+
+    template <typename Bus>
+    CPU<Bus>::~CPU() { memory->set_decode_cache(nullptr); }
 
-    unsigned int CPU::step()
+    template <typename Bus>
+    unsigned int CPU<Bus>::step(unsigned int event_cycles)
     {
-        unsigned int cycles = 0;
+        // Nothing can happen before the next event, so skip the whole gap in one step
+        if (halted && !wake()) {
+            unsigned int cycles = event_cycles > 4 ? event_cycles & ~3u : 4;
+#if defined(GAMEBOY_JIT)
+            if (jit) {
+                jit->check_lockstep(0, cycles);
+            }
+#endif
+            return cycles;
+        }
 
-        // Fetch-decode-execute
-        bool prefixed;
-        Instruction instruction = fetch(prefixed);
-        ExecuteResult result = prefixed ? decode_16bit(instruction) : decode_8bit(instruction);
-        pc = result.next_pc;
-        cycles += result.cycles;
+        unsigned int cycles = 0;
+        unsigned int skipped = 0;
+        cycle_budget = event_cycles;
+
+#if defined(GAMEBOY_JIT)
+        // Compiled blocks, falling back to the interpreter for anything not compiled
+        unsigned int instructions = 1;
+        if (jit && !in_polling_loop()) {
+            cycles = jit->execute(event_cycles, instructions);
+        }
+        if (cycles == 0) {
+            cycles = interpret();
+            skipped = skip_polling_loop(event_cycles, cycles);
+        }
+#else
+        cycles = interpret();
+        skipped = skip_polling_loop(event_cycles, cycles);
+#endif
 
         // Interrupts
         if (auto interrupt = check_interrupts()) {
             cycles += interrupt_service_routine(*interrupt);
         }
 
-        return cycles;
+#if defined(GAMEBOY_JIT)
+        if (jit) {
+            jit->check_lockstep(instructions, cycles);
+        }
+#endif
+        return cycles + skipped;
+    }
+
+#if defined(GAMEBOY_JIT)
+    // The recompiler is specific to the full bus
+    template <> void CPU<MMU>::enable_jit(bool lockstep)
+    {
+        jit.reset(new JIT(this, memory, lockstep));
+        decode_cache->set_fusion(!lockstep);
+        decode_cache->set_jit(jit.get());
+    }
+
+    template <> u64 CPU<MMU>::lockstep_mismatches() const
+    {
+        return jit ? jit->lockstep_mismatches() : 0;
     }
+#endif
 
-    CPU::Instruction CPU::fetch(bool &prefixed)
+    template <typename Bus>
+    unsigned int CPU<Bus>::interpret()
     {
-        u8 inst = memory->read(pc);
-        prefixed = inst == 0xCB;
-        if (prefixed) {
-            inst = memory->read(pc + 1);
+        // Fetch-decode-execute
+        const DecodedInstruction &decoded = decode_cache->fetch(pc);
+        operand = decoded.operand;
+#if defined(GAMEBOY_HEATMAP)
+        // Only the MMU keeps a heatmap
+        if constexpr (requires { memory->count_execute(pc); }) {
+            memory->count_execute(pc);
+        }
+#endif
+#if defined(GAMEBOY_IDLE_SKIP)
+        // Taken before executing, a write to code can free the block
+        polling_loop = decoded.polling_loop;
+        Address fall_through = pc + decoded.length;
+#endif
+#if defined(GAMEBOY_DISPATCH_SWITCH)
+        ExecuteResult result = decoded.handler == &trap ? trap(*this)
+                               : decoded.prefixed       ? decode_16bit(decoded.opcode)
+                                                        : decode_8bit(decoded.opcode);
+#else
+        ExecuteResult result = decoded.handler(*this);
+#endif
+        pc = result.next_pc;
+#if defined(GAMEBOY_IDLE_SKIP)
+        polling_loop_taken = polling_loop && pc != fall_through;
+#endif
+        return result.cycles;
+    }
+
+    template <typename Bus>
+    unsigned int CPU<Bus>::skip_polling_loop([[maybe_unused]] unsigned int event_cycles,
+                                             [[maybe_unused]] unsigned int cycles)
+    {
+#if defined(GAMEBOY_IDLE_SKIP)
+        // Cycles run since the last event. Anything else between two interpreted instructions,
+        // an event, interrupt, halt or compiled block, leaves event_cycles short of what the
+        // last one left and starts the count again.
+        polling_window = event_cycles == polling_window_left ? polling_window + cycles : cycles;
+        polling_window_left = event_cycles > cycles ? event_cycles - cycles : 0;
+
+        // A polling loop that just went round will go round unchanged until an event updates the
+        // IO it reads, unless an interrupt is about to be taken. The whole round has to have run
+        // since the last event, or its reads may have come before the IO changed.
+        if (!polling_loop_taken || event_cycles <= cycles || polling_window < polling_loop ||
+            (ime && memory->pending_interrupts())) {
+            return 0;
+        }
+        unsigned int skipped = (event_cycles - cycles) / polling_loop * polling_loop;
+        skipped_cycles += skipped;
+        polling_window_left -= skipped;
+        return skipped;
+#else
+        return 0;
+#endif
+    }
+
+    static constexpr u8 instruction_length(u8 opcode)
+    {
+        switch (opcode) {
+            case 0x06:
+            case 0x0E:
+            case 0x16:
+            case 0x18:
+            case 0x1E:
+            case 0x20:
+            case 0x26:
+            case 0x28:
+            case 0x2E:
+            case 0x30:
+            case 0x36:
+            case 0x38:
+            case 0x3E:
+            case 0xC6:
+            case 0xCE:
+            case 0xD6:
+            case 0xDE:
+            case 0xE0:
+            case 0xE6:
+            case 0xE8:
+            case 0xEE:
+            case 0xF0:
+            case 0xF6:
+            case 0xF8:
+            case 0xFE:
+                return 2;
+            case 0x01:
+            case 0x08:
+            case 0x11:
+            case 0x21:
+            case 0x31:
+            case 0xC2:
+            case 0xC3:
+            case 0xC4:
+            case 0xCA:
+            case 0xCC:
+            case 0xCD:
+            case 0xD2:
+            case 0xD4:
+            case 0xDA:
+            case 0xDC:
+            case 0xEA:
+            case 0xFA:
+                return 3;
+        }
+        return 1;
+    }
+
+    template <typename Bus>
+    typename CPU<Bus>::DecodedInstruction CPU<Bus>::fetch(Address address) const
+    {
+        DecodedInstruction decoded;
+        decoded.address = address;
+        decoded.polling_loop = 0;
+        decoded.opcode = memory->read(address);
+        decoded.prefixed = decoded.opcode == 0xCB;
+        if (decoded.prefixed) {
+            decoded.opcode = memory->read(address + 1);
+            decoded.handler = handlers_16bit[decoded.opcode];
+            decoded.length = 2;
+            decoded.operand = 0;
+            return decoded;
+        }
+
+        decoded.handler = handlers_8bit[decoded.opcode];
+        decoded.length = instruction_length(decoded.opcode);
+        switch (decoded.length) {
+            case 2: decoded.operand = memory->read(address + 1); break;
+            case 3:
+                decoded.operand =
+                    (u16)memory->read(address + 1) | (u16)memory->read(address + 2) << 8;
+                break;
+            default: decoded.operand = 0; break;
         }
-        return inst;
+        return decoded;
     }
 
-    CPU::ExecuteResult CPU::decode_8bit(Instruction instruction)
+    template <typename Bus>
+    FORCE_INLINE typename CPU<Bus>::ExecuteResult CPU<Bus>::decode_8bit(Instruction instruction)
     {
         switch (instruction) {
             case 0x00: return nop();
@@ -299,10 +492,10 @@ namespace Gameboy
             case 0xEE: return xor_a_n();
             case 0xEF: return rst_n(0x28);
             case 0xF0: return ld_a_n();
-            case 0xF1: return pop_rr(af);
+            case 0xF1: return pop_af();
             case 0xF2: return ld_a_c();
             case 0xF3: return di();
-            case 0xF5: return push_rr(af);
+            case 0xF5: return push_af();
             case 0xF6: return or_a_n();
             case 0xF7: return rst_n(0x30);
             case 0xF8: return ld_hl_sp_dd();
@@ -315,7 +508,8 @@ namespace Gameboy
         return nop();
     }
 
-    CPU::ExecuteResult CPU::decode_16bit(Instruction instruction)
+    template <typename Bus>
+    FORCE_INLINE typename CPU<Bus>::ExecuteResult CPU<Bus>::decode_16bit(Instruction instruction)
     {
         switch (instruction) {
             case 0x00: return rlc_r(B);
@@ -578,25 +772,275 @@ namespace Gameboy
         return nop();
     }
 
-    std::optional<u8> CPU::check_interrupts() 
+    // Each instantiation inlines the decode switch with a constant opcode, so the
+    // switch folds away and register selection is resolved at compile time
+    template <typename Bus>
+    template <typename CPU<Bus>::Instruction opcode>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::execute_8bit(CPU &cpu)
     {
-        // Check interrupt master enable
-        if (!ime) {
-            return std::nullopt;
+        return cpu.decode_8bit(opcode);
+    }
+
+    template <typename Bus>
+    template <typename CPU<Bus>::Instruction opcode>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::execute_16bit(CPU &cpu)
+    {
+        return cpu.decode_16bit(opcode);
+    }
+
+    template <typename Bus>
+    template <typename CPU<Bus>::Fusion fusion, typename CPU<Bus>::Instruction... opcodes>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::execute_fused(CPU &cpu)
+    {
+        // Immediates of the fused instructions are packed into operand in order
+        u16 operands = cpu.operand;
+        Address start = cpu.pc;
+        unsigned int cycles = 0;
+        // A store into the sequence's own code ends it, the rest is decoded again from pc
+        u32 generation = cpu.decode_cache->generation();
+        auto execute = [&](auto opcode) {
+            if (cpu.decode_cache->generation() != generation) {
+                return;
+            }
+            cpu.operand = operands;
+            operands >>= 8 * (instruction_length(opcode) - 1);
+            ExecuteResult result = cpu.decode_8bit(opcode);
+            cpu.pc = result.next_pc;
+            cycles += result.cycles;
+        };
+        (execute(std::integral_constant<Instruction, opcodes>()), ...);
+
+        cpu.fusions[(std::size_t)fusion]++;
+        Address next_pc = cpu.pc;
+        cpu.pc = start;
+
+        // A loop that branched back to itself can run its remaining iterations as one transfer
+        if constexpr (fusion == Fusion::Copy || fusion == Fusion::Fill) {
+            constexpr bool counter_b = ((opcodes == 0x05) || ...);
+            constexpr bool step_de = ((opcodes == 0x13) || ...);
+            if (next_pc == start && cpu.decode_cache->generation() == generation) {
+                cycles += cpu.repeat_transfer(fusion == Fusion::Copy, counter_b ? cpu.B : cpu.C,
+                                              step_de, cycles);
+            }
         }
+        return {next_pc, cycles};
+    }
 
-        // Check each interrupt bit
-        u8 interrupt_enable = memory->read(0xFFFF);
-        u8 interrupt_flag = memory->read(0xFF0F);
-        for (u8 i = 0; i <= I_JOYPAD; i++) {
-            if (FLAG_SET(interrupt_enable, i) && FLAG_SET(interrupt_flag, i)) {
-                return i;
+    template <typename Bus>
+    unsigned int CPU<Bus>::repeat_transfer(bool copy, Register8 &counter, bool step_de,
+                                           unsigned int iteration)
+    {
+        // Only iterations that leave the counter non-zero, and only as many as fit before the
+        // next event, so the final iteration and any interrupt still happen on time
+        if (counter <= 1 || cycle_budget <= iteration || (ime && memory->pending_interrupts())) {
+            return 0;
+        }
+        u16 count = std::min<unsigned int>(counter - 1, (cycle_budget - iteration) / iteration);
+        if (count == 0) {
+            return 0;
+        }
+
+        if (copy) {
+            u16 length = step_de ? count : 1;
+            const u8 *src = memory->read_span(hl, count);
+            u8 *dst = memory->write_span(de, length);
+            // Overlapping ranges would see their own writes, which a host copy does not
+            if (!src || !dst || (hl < de + length && de < hl + count)) {
+                return 0;
+            }
+            if (step_de) {
+                std::memcpy(dst, src, count);
+                de = de + count;
+            } else {
+                dst[0] = src[count - 1];
+            }
+            A = src[count - 1];
+        } else {
+            u8 *dst = memory->write_span(hl, count);
+            if (!dst) {
+                return 0;
             }
+            std::memset(dst, A, count);
         }
-        return std::nullopt;
+        hl = hl + count;
+        counter = dec_f(counter - count + 1);
+        return count * iteration;
+    }
+
+    template <typename Bus>
+    std::size_t CPU<Bus>::fuse(DecodedInstruction *instructions, std::size_t count) const
+    {
+        struct Pattern {
+            std::array<Instruction, 5> opcodes;
+            std::size_t length;
+            Handler handler;
+        };
+
+        // Only the last instruction of a pattern may branch
+        static constexpr Pattern patterns[] = {
+            // LD A,(HL+); LD (DE),A; INC DE; DEC C; JR NZ
+            {{0x2A, 0x12, 0x13, 0x0D, 0x20},
+             5,
+             &execute_fused<Fusion::Copy, 0x2A, 0x12, 0x13, 0x0D, 0x20>},
+            // LD A,(HL+); LD (DE),A; DEC C; JR NZ
+            {{0x2A, 0x12, 0x0D, 0x20}, 4, &execute_fused<Fusion::Copy, 0x2A, 0x12, 0x0D, 0x20>},
+            // LD A,(HL+); LD (DE),A; INC DE; DEC B; JR NZ
+            {{0x2A, 0x12, 0x13, 0x05, 0x20},
+             5,
+             &execute_fused<Fusion::Copy, 0x2A, 0x12, 0x13, 0x05, 0x20>},
+            // LD (HL+),A; DEC B/C; JR NZ
+            {{0x22, 0x05, 0x20}, 3, &execute_fused<Fusion::Fill, 0x22, 0x05, 0x20>},
+            {{0x22, 0x0D, 0x20}, 3, &execute_fused<Fusion::Fill, 0x22, 0x0D, 0x20>},
+            // XOR A; LD (HL+),A
+            {{0xAF, 0x22}, 2, &execute_fused<Fusion::Clear, 0xAF, 0x22>},
+            // CP n; JR cc
+            {{0xFE, 0x20}, 2, &execute_fused<Fusion::CompareBranch, 0xFE, 0x20>},
+            {{0xFE, 0x28}, 2, &execute_fused<Fusion::CompareBranch, 0xFE, 0x28>},
+            {{0xFE, 0x30}, 2, &execute_fused<Fusion::CompareBranch, 0xFE, 0x30>},
+            {{0xFE, 0x38}, 2, &execute_fused<Fusion::CompareBranch, 0xFE, 0x38>},
+        };
+
+        for (const Pattern &pattern : patterns) {
+            if (pattern.length > count) {
+                continue;
+            }
+            bool match = true;
+            for (std::size_t i = 0; i < pattern.length && match; i++) {
+                match = !instructions[i].prefixed && !instructions[i].polling_loop &&
+                        instructions[i].opcode == pattern.opcodes[i];
+            }
+            if (!match) {
+                continue;
+            }
+
+            DecodedInstruction &fused = instructions[0];
+            u16 operands = 0;
+            u8 shift = 0;
+            u8 length = 0;
+            for (std::size_t i = 0; i < pattern.length; i++) {
+                operands |= instructions[i].operand << shift;
+                shift += 8 * (instructions[i].length - 1);
+                length += instructions[i].length;
+            }
+            fused.handler = pattern.handler;
+            fused.operand = operands;
+            fused.length = length;
+            return pattern.length;
+        }
+        return 1;
+    }
+
+    template <typename Bus> void CPU<Bus>::set_fusion(bool enabled)
+    {
+        decode_cache->set_fusion(enabled);
+    }
+
+    template <typename Bus> void CPU<Bus>::set_breakpoint(u16 address)
+    {
+        decode_cache->set_breakpoint(address);
+    }
+
+    template <typename Bus> void CPU<Bus>::clear_breakpoint(u16 address)
+    {
+        decode_cache->clear_breakpoint(address);
+        if (breakpoint_hit == address) {
+            breakpoint_hit = no_breakpoint;
+        }
+    }
+
+    template <typename Bus> void CPU<Bus>::set_trap_handler(TrapHandler handler, void *context)
+    {
+        trap_handler = handler;
+        trap_context = context;
+    }
+
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::trap(CPU &cpu)
+    {
+        // Stands in for the instruction at a breakpoint. The first time through it only reports
+        // and takes no cycles, the next step runs the instruction it replaced.
+        DecodedInstruction instruction = cpu.fetch(cpu.pc);
+        if (cpu.breakpoint_hit != cpu.pc) {
+            cpu.breakpoint_hit = cpu.pc;
+            if (cpu.trap_handler) {
+                Trap hit = {Trap::Kind::Execute, cpu.pc, instruction.opcode};
+                cpu.trap_handler(cpu.trap_context, hit);
+            }
+            return {cpu.pc, 0};
+        }
+
+        cpu.breakpoint_hit = no_breakpoint;
+        cpu.operand = instruction.operand;
+#if defined(GAMEBOY_DISPATCH_SWITCH)
+        return instruction.prefixed ? cpu.decode_16bit(instruction.opcode)
+                                    : cpu.decode_8bit(instruction.opcode);
+#else
+        return instruction.handler(cpu);
+#endif
     }
 
-    unsigned int CPU::interrupt_service_routine(u8 interrupt)
+    template <typename Bus> const char *CPU<Bus>::fusion_name(Fusion fusion)
+    {
+        switch (fusion) {
+            case Fusion::Copy: return "copy loop";
+            case Fusion::Fill: return "fill loop";
+            case Fusion::Clear: return "clear";
+            case Fusion::CompareBranch: return "compare and branch";
+            case Fusion::Count: break;
+        }
+        return "";
+    }
+
+    template <typename Bus>
+    template <std::size_t... opcodes>
+    constexpr typename CPU<Bus>::HandlerTable
+    CPU<Bus>::make_handlers_8bit(std::index_sequence<opcodes...>)
+    {
+        return {&execute_8bit<opcodes>...};
+    }
+
+    template <typename Bus>
+    template <std::size_t... opcodes>
+    constexpr typename CPU<Bus>::HandlerTable
+    CPU<Bus>::make_handlers_16bit(std::index_sequence<opcodes...>)
+    {
+        return {&execute_16bit<opcodes>...};
+    }
+
+    template <typename Bus>
+    const typename CPU<Bus>::HandlerTable CPU<Bus>::handlers_8bit =
+        make_handlers_8bit(std::make_index_sequence<256>());
+    template <typename Bus>
+    const typename CPU<Bus>::HandlerTable CPU<Bus>::handlers_16bit =
+        make_handlers_16bit(std::make_index_sequence<256>());
+
+    template <typename Bus>
+    bool CPU<Bus>::wake()
+    {
+        // HALT ends on any enabled interrupt request, even with IME off, STOP only on joypad
+        u8 pending = memory->pending_interrupts();
+        if (pending & (stopped ? 1 << I_JOYPAD : 0x1F)) {
+            halted = false;
+            stopped = false;
+        }
+        return !halted;
+    }
+
+    template <typename Bus>
+    std::optional<u8> CPU<Bus>::check_interrupts() 
+    {
+        // Nothing pending is the common case, one test of the cached IE & IF
+        u8 pending = memory->pending_interrupts();
+        if (!pending || !ime) {
+            return std::nullopt;
+        }
+
+        // The lowest set bit has the highest priority
+        return (u8)std::countr_zero(pending);
+    }
+
+    template <typename Bus>
+    unsigned int CPU<Bus>::interrupt_service_routine(u8 interrupt)
     {
         // Acknowledge interupt
         u8 interrupt_flag = memory->read(0xFF0F);
@@ -618,107 +1062,123 @@ namespace Gameboy
         return 20;
     }
 
-    CPU::ExecuteResult CPU::ld_r_r(Register8 &dst, Register8 src)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_r_r(Register8 &dst, Register8 src)
     {
         dst = src;
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::ld_r_n(Register8 &dst)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_r_n(Register8 &dst)
     {
         u8 value = read_next_8();
         dst = value;
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::ld_r_adr(Register8 &dst, Address src)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_r_adr(Register8 &dst, Address src)
     {
         dst = memory->read(src);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ld_adr_r(Address dst, Register8 src)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_adr_r(Address dst, Register8 src)
     {
         memory->write(dst, src);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ld_hl_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_hl_n()
     {
         u8 value = read_next_8();
         memory->write(hl, value);
         return {static_cast<Address>(pc + 2), 12};
     }
 
-    CPU::ExecuteResult CPU::ld_a_nn()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_a_nn()
     {
         Address addr = read_next_16();
         A = memory->read(addr);
         return {static_cast<Address>(pc + 3), 16};
     }
 
-    CPU::ExecuteResult CPU::ld_nn_a()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_nn_a()
     {
         Address addr = read_next_16();
         memory->write(addr, A);
         return {static_cast<Address>(pc + 3), 16};
     }
 
-    CPU::ExecuteResult CPU::ld_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_a_n()
     {
         u8 offset = read_next_8();
         A = memory->read_io(offset);
         return {static_cast<Address>(pc + 2), 12};
     }
 
-    CPU::ExecuteResult CPU::ld_n_a()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_n_a()
     {
         u8 offset = read_next_8();
         memory->write_io(offset, A);
         return {static_cast<Address>(pc + 2), 12};
     }
 
-    CPU::ExecuteResult CPU::ld_a_c()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_a_c()
     {
         A = memory->read_io(C);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ld_c_a()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_c_a()
     {
         memory->write_io(C, A);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ldi_hl_a()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ldi_hl_a()
     {
         memory->write(hl, A);
         hl = hl + 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ldi_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ldi_a_hl()
     {
         A = memory->read(hl);
         hl = hl + 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ldd_hl_a()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ldd_hl_a()
     {
         memory->write(hl, A);
         hl = hl - 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ldd_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ldd_a_hl()
     {
         A = memory->read(hl);
         hl = hl - 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::ld_rr_nn(Register16 &dst)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_rr_nn(Register16 &dst)
     {
         u16 value = read_next_16();
         dst = value;
@@ -726,7 +1186,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 3), 12};
     }
 
-    CPU::ExecuteResult CPU::ld_nn_sp()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_nn_sp()
     {
         Address addr = read_next_16();
         memory->write(addr, sp.lo());
@@ -734,13 +1195,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 3), 20};
     }
 
-    CPU::ExecuteResult CPU::ld_sp_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_sp_hl()
     {
         sp = hl;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::push_rr(Register16 src)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::push_rr(Register16 src)
     {
         memory->write(sp - 1, src.hi());
         memory->write(sp - 2, src.lo());
@@ -748,7 +1211,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 16};
     }
 
-    CPU::ExecuteResult CPU::pop_rr(Register16 &dst)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::push_af()
+    {
+        materialize_flags();
+        return push_rr(af);
+    }
+
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::pop_rr(Register16 &dst)
     {
         dst.lo() = memory->read(sp);
         dst.hi() = memory->read(sp + 1);
@@ -757,193 +1228,230 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 12};
     }
 
-    CPU::ExecuteResult CPU::add_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::pop_af()
+    {
+        // The popped F replaces any pending flags
+        materialize_flags();
+        return pop_rr(af);
+    }
+
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::add_a_r(Register8 op)
     {
         A = add_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::add_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::add_a_n()
     {
         u8 n = read_next_8();
         A = add_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::add_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::add_a_hl()
     {
         u8 op = memory->read(hl);
         A = add_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::adc_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::adc_a_r(Register8 op)
     {
         A = adc_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::adc_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::adc_a_n()
     {
         u8 n = read_next_8();
         A = adc_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::adc_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::adc_a_hl()
     {
         u8 op = memory->read(hl);
         A = adc_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::sub_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sub_a_r(Register8 op)
     {
         A = sub_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::sub_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sub_a_n()
     {
         u8 n = read_next_8();
         A = sub_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::sub_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sub_a_hl()
     {
         u8 op = memory->read(hl);
         A = sub_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::sbc_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sbc_a_r(Register8 op)
     {
         A = sbc_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::sbc_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sbc_a_n()
     {
         u8 n = read_next_8();
         A = sbc_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::sbc_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sbc_a_hl()
     {
         u8 op = memory->read(hl);
         A = sbc_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::and_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::and_a_r(Register8 op)
     {
         A = and_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::and_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::and_a_n()
     {
         u8 n = read_next_8();
         A = and_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::and_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::and_a_hl()
     {
         u8 op = memory->read(hl);
         A = and_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::xor_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::xor_a_r(Register8 op)
     {
         A = xor_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::xor_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::xor_a_n()
     {
         u8 n = read_next_8();
         A = xor_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::xor_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::xor_a_hl()
     {
         u8 op = memory->read(hl);
         A = xor_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::or_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::or_a_r(Register8 op)
     {
         A = or_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::or_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::or_a_n()
     {
         u8 n = read_next_8();
         A = or_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::or_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::or_a_hl()
     {
         u8 op = memory->read(hl);
         A = or_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::cp_a_r(Register8 op)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::cp_a_r(Register8 op)
     {
         cp_f(A, op);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::cp_a_n()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::cp_a_n()
     {
         u8 n = read_next_8();
         cp_f(A, n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::cp_a_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::cp_a_hl()
     {
         u8 op = memory->read(hl);
         cp_f(A, op);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::inc_r(Register8 &reg)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::inc_r(Register8 &reg)
     {
         reg = inc_f(reg);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::inc_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::inc_hl()
     {
         u8 op = memory->read(hl);
         memory->write(hl, inc_f(op));
         return {static_cast<Address>(pc + 1), 12};
     }
 
-    CPU::ExecuteResult CPU::dec_r(Register8 &reg)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::dec_r(Register8 &reg)
     {
         reg = dec_f(reg);
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::dec_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::dec_hl()
     {
         u8 op = memory->read(hl);
         memory->write(hl, dec_f(op));
         return {static_cast<Address>(pc + 1), 12};
     }
 
-    CPU::ExecuteResult CPU::daa()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::daa()
     {
         if (get_flag_n()) {
             if (get_flag_c()) {
@@ -966,7 +1474,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::cpl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::cpl()
     {
         A ^= 0xFF;
         set_flag_n(true);
@@ -974,25 +1483,29 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::add_hl_rr(Register16 rr)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::add_hl_rr(Register16 rr)
     {
         hl = add_f(hl, rr);
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::inc_rr(Register16 &rr)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::inc_rr(Register16 &rr)
     {
         rr = rr + 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::dec_rr(Register16 &rr)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::dec_rr(Register16 &rr)
     {
         rr = rr - 1;
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::add_sp_dd()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::add_sp_dd()
     {
         u8 op = read_next_8();
         bool sign = BIT_7(op);
@@ -1008,7 +1521,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::ld_hl_sp_dd()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ld_hl_sp_dd()
     {
         u8 op = read_next_8();
         bool sign = op & 0x80;
@@ -1025,7 +1539,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 12};
     }
 
-    CPU::ExecuteResult CPU::rlca()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rlca()
     {
         set_flag_z(false);
         set_flag_n(false);
@@ -1035,7 +1550,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::rla()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rla()
     {
         u8 carry = get_flag_c();
         set_flag_z(false);
@@ -1046,7 +1562,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::rrca()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rrca()
     {
         set_flag_z(false);
         set_flag_n(false);
@@ -1056,7 +1573,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::rra()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rra()
     {
         u8 carry = get_flag_c();
         set_flag_z(false);
@@ -1067,7 +1585,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::rlc_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rlc_r(Register8 &r)
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1077,7 +1596,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::rlc_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rlc_hl()
     {
         u8 op = memory->read(hl);
         set_flag_n(false);
@@ -1089,7 +1609,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::rl_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rl_r(Register8 &r)
     {
         u8 carry = get_flag_c();
         set_flag_n(false);
@@ -1100,7 +1621,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::rl_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rl_hl()
     {
         u8 op = memory->read(hl);
         u8 carry = get_flag_c();
@@ -1113,7 +1635,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::rrc_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rrc_r(Register8 &r)
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1123,7 +1646,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::rrc_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rrc_hl()
     {
         u8 op = memory->read(hl);
         set_flag_n(false);
@@ -1135,7 +1659,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::rr_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rr_r(Register8 &r)
     {
         u8 carry = get_flag_c();
         set_flag_n(false);
@@ -1146,7 +1671,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::rr_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rr_hl()
     {
         u8 op = memory->read(hl);
         u8 carry = get_flag_c();
@@ -1159,7 +1685,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::sla_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sla_r(Register8 &r)
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1169,7 +1696,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::sla_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sla_hl()
     {
         u8 op = memory->read(hl);
         set_flag_n(false);
@@ -1181,7 +1709,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::sra_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sra_r(Register8 &r)
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1191,7 +1720,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::sra_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::sra_hl()
     {
         u8 op = memory->read(hl);
         set_flag_n(false);
@@ -1203,7 +1733,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::srl_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::srl_r(Register8 &r)
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1213,7 +1744,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::srl_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::srl_hl()
     {
         u8 op = memory->read(hl);
         set_flag_n(false);
@@ -1225,7 +1757,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::swap_r(Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::swap_r(Register8 &r)
     {
         u8 hi = HI(r);
         r = r << 4 | hi >> 4;
@@ -1236,7 +1769,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::swap_hl()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::swap_hl()
     {
         u8 op = memory->read(hl);
         u8 hi = HI(op);
@@ -1249,7 +1783,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::bit_n_r(u8 n, Register8 r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::bit_n_r(u8 n, Register8 r)
     {
         bool bit = (r >> n) & 1;
         set_flag_z(!bit);
@@ -1258,7 +1793,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::bit_n_hl(u8 n)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::bit_n_hl(u8 n)
     {
         u8 op = memory->read(hl);
         bool bit = (op >> n) & 1;
@@ -1268,13 +1804,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 12};
     }
 
-    CPU::ExecuteResult CPU::set_n_r(u8 n, Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::set_n_r(u8 n, Register8 &r)
     {
         r |= 1 << n;
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::set_n_hl(u8 n)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::set_n_hl(u8 n)
     {
         u8 op = memory->read(hl);
         op |= 1 << n;
@@ -1282,13 +1820,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::res_n_r(u8 n, Register8 &r)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::res_n_r(u8 n, Register8 &r)
     {
         r &= ~(1 << n);
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::res_n_hl(u8 n)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::res_n_hl(u8 n)
     {
         u8 op = memory->read(hl);
         op &= ~(1 << n);
@@ -1296,7 +1836,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 16};
     }
 
-    CPU::ExecuteResult CPU::ccf()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ccf()
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1304,7 +1845,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::scf()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::scf()
     {
         set_flag_n(false);
         set_flag_h(false);
@@ -1312,41 +1854,50 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::nop() { return {static_cast<Address>(pc + 1), 4}; }
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::nop() { return {static_cast<Address>(pc + 1), 4}; }
 
-    CPU::ExecuteResult CPU::halt()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::halt()
     {
         halted = true;
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::stop()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::stop()
     {
         halted = true;
+        stopped = true;
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::di()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::di()
     {
         ime = false;
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::ei()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ei()
     {
         ime = true;
         return {static_cast<Address>(pc + 1), 4};
     }
 
-    CPU::ExecuteResult CPU::jp_nn()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::jp_nn()
     {
         u16 nn = read_next_16();
         return {nn, 16};
     }
 
-    CPU::ExecuteResult CPU::jp_hl() { return {hl, 4}; }
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::jp_hl() { return {hl, 4}; }
 
-    CPU::ExecuteResult CPU::jp_f_nn(u8 flag, bool value)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::jp_f_nn(u8 flag, bool value)
     {
         if (get_flag(flag) == value) {
             return jp_nn();
@@ -1354,13 +1905,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 3), 12};
     }
 
-    CPU::ExecuteResult CPU::jr_dd()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::jr_dd()
     {
         i8 dd = read_next_8();
         return {static_cast<Address>(pc + 2 + dd), 12};
     }
 
-    CPU::ExecuteResult CPU::jr_f_dd(u8 flag, bool value)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::jr_f_dd(u8 flag, bool value)
     {
         if (get_flag(flag) == value) {
             return jr_dd();
@@ -1368,7 +1921,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 2), 8};
     }
 
-    CPU::ExecuteResult CPU::call_nn()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::call_nn()
     {
         Register16 return_pc = pc + 3;
         memory->write(sp - 1, return_pc.hi());
@@ -1379,7 +1933,8 @@ namespace Gameboy
         return {nn, 24};
     }
 
-    CPU::ExecuteResult CPU::call_f_nn(u8 flag, bool value)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::call_f_nn(u8 flag, bool value)
     {
         if (get_flag(flag) == value) {
             return call_nn();
@@ -1387,7 +1942,8 @@ namespace Gameboy
         return {static_cast<Address>(pc + 3), 12};
     }
 
-    CPU::ExecuteResult CPU::ret()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ret()
     {
         Register16 return_pc;
         return_pc.lo() = memory->read(sp);
@@ -1396,7 +1952,8 @@ namespace Gameboy
         return {return_pc, 16};
     }
 
-    CPU::ExecuteResult CPU::ret_f(u8 flag, bool value)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::ret_f(u8 flag, bool value)
     {
         if (get_flag(flag) == value) {
             Register16 return_pc;
@@ -1408,13 +1965,15 @@ namespace Gameboy
         return {static_cast<Address>(pc + 1), 8};
     }
 
-    CPU::ExecuteResult CPU::reti()
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::reti()
     {
         ime = true;
         return ret();
     }
 
-    CPU::ExecuteResult CPU::rst_n(u8 n)
+    template <typename Bus>
+    typename CPU<Bus>::ExecuteResult CPU<Bus>::rst_n(u8 n)
     {
         Register16 return_pc = pc + 1;
         memory->write(sp - 1, return_pc.hi());
@@ -1423,24 +1982,21 @@ namespace Gameboy
         return {n, 24};
     }
 
-    u8 CPU::read_next_8() const { return memory->read(pc + 1); }
+    template <typename Bus>
+    u8 CPU<Bus>::read_next_8() const { return (u8)operand; }
 
-    u16 CPU::read_next_16() const
-    {
-        return (u16)memory->read(pc + 1) | (u16)memory->read(pc + 2) << 8;
-    }
+    template <typename Bus>
+    u16 CPU<Bus>::read_next_16() const { return operand; }
 
-    u8 CPU::add_f(u8 a, u8 b)
+    template <typename Bus>
+    u8 CPU<Bus>::add_f(u8 a, u8 b)
     {
-        u16 res = (u16)a + (u16)b;
-        set_flag_z((u8)res == 0);
-        set_flag_n(false);
-        set_flag_h(LO(a) + LO(b) > 0xF);
-        set_flag_c(res > 0xFF);
-        return (u8)res;
+        update_flags(FlagOp::Add, a, b);
+        return a + b;
     }
 
-    u16 CPU::add_f(u16 a, u16 b)
+    template <typename Bus>
+    u16 CPU<Bus>::add_f(u16 a, u16 b)
     {
         u32 res = (u32)a + (u32)b;
         set_flag_n(false);
@@ -1449,92 +2005,111 @@ namespace Gameboy
         return res;
     }
 
-    u8 CPU::adc_f(u8 a, u8 b)
+    template <typename Bus>
+    u8 CPU<Bus>::adc_f(u8 a, u8 b)
     {
         u8 c = get_flag_c();
-        u16 res = (u16)a + (u16)b + c;
-        set_flag_z((u8)res == 0);
-        set_flag_n(false);
-        set_flag_h(LO(a) + LO(b) + c > 0xF);
-        set_flag_c(res > 0xFF);
-        return (u8)res;
+        update_flags(FlagOp::Adc, a, b, c);
+        return a + b + c;
     }
 
-    u8 CPU::sub_f(u8 a, u8 b)
+    template <typename Bus>
+    u8 CPU<Bus>::sub_f(u8 a, u8 b)
     {
-        u8 res = a - b;
-        set_flag_z(res == 0);
-        set_flag_n(true);
-        set_flag_h(LO(a) < LO(b));
-        set_flag_c(a < b);
-        return res;
+        update_flags(FlagOp::Sub, a, b);
+        return a - b;
     }
 
-    u8 CPU::sbc_f(u8 a, u8 b)
+    template <typename Bus>
+    u8 CPU<Bus>::sbc_f(u8 a, u8 b)
     {
         u8 c = get_flag_c();
-        u8 res = a - b - c;
-        set_flag_z(res == 0);
-        set_flag_n(true);
-        set_flag_h(LO(a) < LO(b) + c);
-        set_flag_c(a < b + c);
-        return res;
-    }
-
-    u8 CPU::and_f(u8 a, u8 b)
-    {
-        u8 res = a & b;
-        set_flag_z(res == 0);
-        set_flag_n(false);
-        set_flag_h(true);
-        set_flag_c(false);
-        return res;
-    }
-
-    u8 CPU::xor_f(u8 a, u8 b)
-    {
-        u8 res = a ^ b;
-        set_flag_z(res == 0);
-        set_flag_n(false);
-        set_flag_h(false);
-        set_flag_c(false);
-        return res;
-    }
-
-    u8 CPU::or_f(u8 a, u8 b)
-    {
-        u8 res = a | b;
-        set_flag_z(res == 0);
-        set_flag_n(false);
-        set_flag_h(false);
-        set_flag_c(false);
-        return res;
-    }
-
-    void CPU::cp_f(u8 a, u8 b)
-    {
-        u8 res = a - b;
-        set_flag_z(res == 0);
-        set_flag_n(true);
-        set_flag_h(LO(a) < LO(b));
-        set_flag_c(a < b);
-    }
-
-    u8 CPU::inc_f(u8 a)
-    {
-        u8 res = a + 1;
-        set_flag_z(res == 0);
-        set_flag_n(false);
-        set_flag_h(LO(a) + 1 > 0xF);
-        return res;
+        update_flags(FlagOp::Sbc, a, b, c);
+        return a - b - c;
+    }
+
+    template <typename Bus>
+    u8 CPU<Bus>::and_f(u8 a, u8 b)
+    {
+        update_flags(FlagOp::And, a, b);
+        return a & b;
+    }
+
+    template <typename Bus>
+    u8 CPU<Bus>::xor_f(u8 a, u8 b)
+    {
+        update_flags(FlagOp::Xor, a, b);
+        return a ^ b;
+    }
+
+    template <typename Bus>
+    u8 CPU<Bus>::or_f(u8 a, u8 b)
+    {
+        update_flags(FlagOp::Or, a, b);
+        return a | b;
+    }
+
+    template <typename Bus>
+    void CPU<Bus>::cp_f(u8 a, u8 b) { update_flags(FlagOp::Sub, a, b); }
+
+    template <typename Bus>
+    u8 CPU<Bus>::inc_f(u8 a)
+    {
+        update_flags(FlagOp::Inc, a, 0, get_flag_c());
+        return a + 1;
+    }
+
+    template <typename Bus>
+    u8 CPU<Bus>::dec_f(u8 a)
+    {
+        update_flags(FlagOp::Dec, a, 0, get_flag_c());
+        return a - 1;
+    }
+
+    template <typename Bus>
+    u8 CPU<Bus>::compute_flags(FlagOp op, u8 a, u8 b, u8 carry)
+    {
+        bool z = false, n = false, h = false, c = compute_carry(op, a, b, carry);
+        switch (op) {
+            case FlagOp::Add:
+                z = (u8)(a + b) == 0;
+                h = LO(a) + LO(b) > 0xF;
+                break;
+            case FlagOp::Adc:
+                z = (u8)(a + b + carry) == 0;
+                h = LO(a) + LO(b) + carry > 0xF;
+                break;
+            case FlagOp::Sub:
+                z = a == b;
+                n = true;
+                h = LO(a) < LO(b);
+                break;
+            case FlagOp::Sbc:
+                z = (u8)(a - b - carry) == 0;
+                n = true;
+                h = LO(a) < LO(b) + carry;
+                break;
+            case FlagOp::And:
+                z = (a & b) == 0;
+                h = true;
+                break;
+            case FlagOp::Xor: z = (a ^ b) == 0; break;
+            case FlagOp::Or: z = (a | b) == 0; break;
+            case FlagOp::Inc:
+                z = a == 0xFF;
+                h = LO(a) == 0xF;
+                break;
+            case FlagOp::Dec:
+                z = a == 1;
+                n = true;
+                h = LO(a) == 0;
+                break;
+            case FlagOp::None: break;
+        }
+        return z << FLAG_Z | n << FLAG_N | h << FLAG_H | c << FLAG_C;
     }
 
-    u8 CPU::dec_f(u8 a)
-    {
-        u8 res = a - 1;
-        set_flag_z(res == 0);
-        set_flag_n(true);
-        set_flag_h(LO(a) < 1);
-        return res;
-    }
+    template class CPU<FlatBus>;
+    template class CPU<MMU>;
+    template class CPU<TracingBus<MMU>>;
 } // namespace Gameboy
\ No newline at end of file
@@ -1,16 +1,30 @@
 #pragma once
 
+#include "trap.h"
 #include "types.h"
 
+#include <array>
+#include <bit>
+#include <memory>
 #include <optional>
+#include <utility>
 
 namespace Gameboy
 {
-    class MMU;
     class Display;
+    class JIT;
+    template <typename Bus> class DecodeCache;
 
-    class CPU
+    // The core is specialised on its memory bus so every access inlines. A bus provides
+    // read/write, read_io/write_io, pending_interrupts() (IE & IF), rom_bank(), the decode
+    // cache hooks set_decode_cache(), mark_code_page() and dma_active(), and
+    // read_span()/write_span() for bulk transfers. MMU is the full cartridge and IO bus, FlatBus plain RAM for tests and
+    // TracingBus logs every access of the bus it wraps.
+    template <typename Bus> class CPU
     {
+        friend class DecodeCache<Bus>;
+        friend class JIT;
+
       private:
         typedef u8 Register8;
         typedef u16 Address;
@@ -25,40 +39,125 @@ namespace Gameboy
             }
         };
 
+        // A native u16, with the 8-bit halves addressed in place according to host byte order
         class Register16
         {
           public:
-            Register16() : reg_hi(0), reg_lo(0) {}
-            Register16(u16 value) : reg_hi((u8)(value >> 8)), reg_lo((u8)value) {}
+            Register16() : value(0) {}
+            Register16(u16 value) : value(value) {}
 
-            Register8 &hi() { return reg_hi; }
-            Register8 hi() const { return reg_hi; }
-            Register8 &lo() { return reg_lo; }
-            Register8 lo() const { return reg_lo; }
+            Register8 &hi() { return bytes()[hi_byte]; }
+            Register8 hi() const { return bytes()[hi_byte]; }
+            Register8 &lo() { return bytes()[lo_byte]; }
+            Register8 lo() const { return bytes()[lo_byte]; }
 
-            operator u16() const { return (u16)reg_hi << 8 | reg_lo; }
-            Register16 &operator=(u16 value)
+            operator u16() const { return value; }
+            Register16 &operator=(u16 new_value)
             {
-                reg_hi = (u8)(value >> 8);
-                reg_lo = (u8)value;
+                value = new_value;
                 return *this;
             }
 
           private:
-            Register8 reg_hi;
-            Register8 reg_lo;
+            static constexpr int hi_byte = std::endian::native == std::endian::little ? 1 : 0;
+            static constexpr int lo_byte = 1 - hi_byte;
+
+            Register8 *bytes() { return reinterpret_cast<Register8 *>(&value); }
+            const Register8 *bytes() const { return reinterpret_cast<const Register8 *>(&value); }
+
+          private:
+            u16 value;
+        };
+
+        typedef ExecuteResult (*Handler)(CPU &cpu);
+        typedef std::array<Handler, 256> HandlerTable;
+
+        enum class FlagOp : u8 { None, Add, Adc, Sub, Sbc, And, Xor, Or, Inc, Dec };
+
+        // The last flag-setting ALU operation, evaluated only when F is read
+        struct LazyFlags {
+            FlagOp op;
+            u8 a;
+            u8 b;
+            u8 carry;
+        };
+
+        struct DecodedInstruction {
+            Handler handler;
+            Address address;
+            u16 operand;
+            Instruction opcode;
+            u8 length;
+            bool prefixed;
+
+            // Cycles per iteration if this is part of a side-effect free polling loop
+            u8 polling_loop;
         };
 
       public:
-        CPU(MMU *memory, Display *display);
+        // Opcode sequences the decode cache runs as a single superinstruction
+        enum class Fusion : u8 { Copy, Fill, Clear, CompareBranch, Count };
+        typedef std::array<u64, (std::size_t)Fusion::Count> FusionStats;
+
+        CPU(Bus *memory, Display *display);
+        ~CPU();
+
+        // Runs one instruction, or while halted sleeps until the next scheduled event, which is
+        // event_cycles away (timer overflow, PPU mode change, serial transfer or joypad)
+        unsigned int step(unsigned int event_cycles);
+
+#if defined(GAMEBOY_JIT)
+        // Only defined for CPU<MMU>
+        void enable_jit(bool lockstep = false);
+        // Steps where the JIT and the shadow interpreter disagreed, with lockstep enabled
+        u64 lockstep_mismatches() const;
+#endif
+#if defined(GAMEBOY_IDLE_SKIP)
+        u64 idle_cycles_skipped() const { return skipped_cycles; }
+#endif
+
+        // How many times each superinstruction has run
+        const FusionStats &fusion_stats() const { return fusions; }
+        static const char *fusion_name(Fusion fusion);
+        // On by default, applies to blocks decoded from then on
+        void set_fusion(bool enabled);
 
-        unsigned int step();
+        // Breakpoints stop the CPU in front of the instruction at an address, in whichever bank
+        // is mapped there. Only blocks decoded from that address carry the trap.
+        void set_breakpoint(u16 address);
+        void clear_breakpoint(u16 address);
+        void set_trap_handler(TrapHandler handler, void *context);
 
       private:
-        Instruction fetch(bool &prefixed);
+        unsigned int interpret();
+        unsigned int skip_polling_loop(unsigned int event_cycles, unsigned int cycles);
+        bool in_polling_loop() const
+        {
+#if defined(GAMEBOY_IDLE_SKIP)
+            return polling_loop;
+#else
+            return false;
+#endif
+        }
+        DecodedInstruction fetch(Address address) const;
         ExecuteResult decode_8bit(Instruction instruction);
         ExecuteResult decode_16bit(Instruction instruction);
 
+        // Opcode handlers with the decode folded in at compile time
+        template <Instruction opcode> static ExecuteResult execute_8bit(CPU &cpu);
+        template <Instruction opcode> static ExecuteResult execute_16bit(CPU &cpu);
+        template <Fusion fusion, Instruction... opcodes>
+        static ExecuteResult execute_fused(CPU &cpu);
+        static ExecuteResult trap(CPU &cpu);
+        std::size_t fuse(DecodedInstruction *instructions, std::size_t count) const;
+        unsigned int repeat_transfer(bool copy, Register8 &counter, bool step_de,
+                                     unsigned int iteration);
+        template <std::size_t... opcodes>
+        static constexpr HandlerTable make_handlers_8bit(std::index_sequence<opcodes...>);
+        template <std::size_t... opcodes>
+        static constexpr HandlerTable make_handlers_16bit(std::index_sequence<opcodes...>);
+
+        bool wake();
         std::optional<u8> check_interrupts();
         unsigned int interrupt_service_routine(u8 interupt);
 
@@ -84,7 +183,9 @@ namespace Gameboy
         ExecuteResult ld_nn_sp();
         ExecuteResult ld_sp_hl();
         ExecuteResult push_rr(Register16 src);
+        ExecuteResult push_af();
         ExecuteResult pop_rr(Register16 &dst);
+        ExecuteResult pop_af();
 
         // 8-bit arithmetic/logic instructions
         ExecuteResult add_a_r(Register8 op);
@@ -200,18 +301,101 @@ namespace Gameboy
         bool get_flag_c() const { return get_flag(4); }
         void set_flag_c(bool value) { set_flag(4, value); }
 
-        bool get_flag(u8 flag) const { return af.lo() >> flag & 1; }
+        bool get_flag(u8 flag) const
+        {
+#if defined(GAMEBOY_LAZY_FLAGS)
+            // C is always current in F, only Z/N/H are left pending
+            if (flag == 4) {
+                return af.lo() >> 4 & 1;
+            }
+#endif
+            return flags() >> flag & 1;
+        }
         void set_flag(u8 flag, bool value)
         {
+            materialize_flags();
             af.lo() = (af.lo() & ~(1 << flag)) | (value << flag);
         }
 
+        // Z/N/H/C for the 8-bit ALU operations, computed in one go from their operands
+        static u8 compute_flags(FlagOp op, u8 a, u8 b, u8 carry);
+
+        // Just the carry out, cheap enough to keep F's C bit current even with lazy flags
+        static bool compute_carry(FlagOp op, u8 a, u8 b, u8 carry)
+        {
+            switch (op) {
+                case FlagOp::Add: return a + b > 0xFF;
+                case FlagOp::Adc: return a + b + carry > 0xFF;
+                case FlagOp::Sub: return a < b;
+                case FlagOp::Sbc: return a < b + carry;
+                case FlagOp::Inc:
+                case FlagOp::Dec: return carry;
+                default: return false;
+            }
+        }
+
+        void update_flags(FlagOp op, u8 a, u8 b, u8 carry = 0)
+        {
+#if defined(GAMEBOY_LAZY_FLAGS)
+            lazy_flags = {op, a, b, carry};
+            af.lo() = (af.lo() & 0x0F) | compute_carry(op, a, b, carry) << 4;
+#else
+            af.lo() = (af.lo() & 0x0F) | compute_flags(op, a, b, carry);
+#endif
+        }
+
+        // F with any pending lazy flags evaluated
+        u8 flags() const
+        {
+#if defined(GAMEBOY_LAZY_FLAGS)
+            if (lazy_flags.op != FlagOp::None) {
+                return (af.lo() & 0x0F) |
+                       compute_flags(lazy_flags.op, lazy_flags.a, lazy_flags.b, lazy_flags.carry);
+            }
+#endif
+            return af.lo();
+        }
+
+        void materialize_flags()
+        {
+#if defined(GAMEBOY_LAZY_FLAGS)
+            af.lo() = flags();
+            lazy_flags.op = FlagOp::None;
+#endif
+        }
+
       private:
+        static const HandlerTable handlers_8bit;
+        static const HandlerTable handlers_16bit;
+
         Register16 af, bc, de, hl;
         Register16 sp, pc;
+        u16 operand = 0;
+        FusionStats fusions = {};
+        unsigned int cycle_budget = 0;
+#if defined(GAMEBOY_LAZY_FLAGS)
+        LazyFlags lazy_flags = {FlagOp::None, 0, 0, 0};
+#endif
+#if defined(GAMEBOY_IDLE_SKIP)
+        u8 polling_loop = 0;
+        bool polling_loop_taken = false;
+        unsigned int polling_window = 0;
+        unsigned int polling_window_left = 0;
+        u64 skipped_cycles = 0;
+#endif
         bool halted = false;
+        bool stopped = false;
         bool ime = true;
-        MMU *memory;
+        // The breakpoint the CPU stopped in front of, its instruction runs on the next step
+        static constexpr u32 no_breakpoint = 0x10000;
+        u32 breakpoint_hit = no_breakpoint;
+        TrapHandler trap_handler = nullptr;
+        void *trap_context = nullptr;
+        Bus *memory;
         Display *display;
+        std::unique_ptr<DecodeCache<Bus>> decode_cache;
+#if defined(GAMEBOY_JIT)
+        std::unique_ptr<JIT> jit;
+#endif
     };
 } // namespace Gameboy
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "decode_cache.h"
+
+#include "flat_bus.h"
+#include "jit.h"
+#include "mmu.h"
+#include "tracing_bus.h"
+
+namespace Gameboy
+{
+    template <typename Bus>
+    DecodeCache<Bus>::DecodeCache(const CPU<Bus> *cpu, Bus *memory) : cpu(cpu), memory(memory)
+    {
+    }
+
+    template <typename Bus>
+    void DecodeCache<Bus>::invalidate_page(u8 page)
+    {
+        for (u32 key : page_blocks[page]) {
+            auto it = blocks.find(key);
+            if (it == blocks.end()) {
+                continue;
+            }
+            // A block across two pages is listed under both, the other must not keep its key
+            auto [first_page, last_page] = block_pages(it->second);
+            for (unsigned int other = first_page; other <= last_page; other++) {
+                if (other != page) {
+                    std::erase(page_blocks[other], key);
+                }
+            }
+            blocks.erase(it);
+        }
+        page_blocks[page].clear();
+        lookup.fill({});
+        block = nullptr;
+        invalidations++;
+
+#if defined(GAMEBOY_JIT)
+        if (jit) {
+            jit->invalidate_page(page);
+        }
+#endif
+    }
+
+    template <typename Bus> void DecodeCache<Bus>::switch_bank()
+    {
+        // Blocks are keyed by bank, but code in the switched region that changes its own bank
+        // must not run on from the old one, here or in a compiled chain
+        u16 pc = cpu->pc;
+        if (pc >= 0x4000 && pc < 0x8000) {
+            invalidate_page(pc >> 8);
+        }
+    }
+
+    template <typename Bus> void DecodeCache<Bus>::lock_bus()
+    {
+        // The instruction that started the transfer must not run on through its block, here or
+        // in a compiled chain, into memory that now reads 0xFF
+        u16 pc = cpu->pc;
+        if (pc < 0xFF00) {
+            invalidate_page(pc >> 8);
+        }
+    }
+
+    template <typename Bus> void DecodeCache<Bus>::set_breakpoint(u16 address)
+    {
+        if (!breakpoints[address]) {
+            breakpoints.set(address);
+            page_breakpoints[address >> 8]++;
+            invalidate_page(address >> 8);
+        }
+    }
+
+    template <typename Bus> void DecodeCache<Bus>::clear_breakpoint(u16 address)
+    {
+        if (breakpoints[address]) {
+            breakpoints.reset(address);
+            page_breakpoints[address >> 8]--;
+            invalidate_page(address >> 8);
+        }
+    }
+
+    template <typename Bus>
+    const typename DecodeCache<Bus>::DecodedInstruction &
+    DecodeCache<Bus>::fetch_block(u16 address)
+    {
+        // During OAM DMA everything outside page 0xFF reads 0xFF, RST 38h, whatever blocks were
+        // decoded there. They are kept for when the bus is released.
+        if (memory->dma_active() && address < 0xFF00) {
+            block = nullptr;
+            locked_bus = cpu->fetch(address);
+            return locked_bus;
+        }
+
+        block = &find_block(address);
+        index = 1;
+        return block->front();
+    }
+
+    template <typename Bus>
+    const typename DecodeCache<Bus>::Block &DecodeCache<Bus>::find_block(u16 address)
+    {
+        u32 key = block_key(address);
+
+        // Direct-mapped lookup in front of the block map for branch targets
+        BlockLookup &entry = lookup[address % lookup_size];
+        if (entry.block && entry.key == key) {
+            return *entry.block;
+        }
+
+        auto it = blocks.find(key);
+        if (it == blocks.end()) {
+            it = blocks.emplace(key, decode_block(address)).first;
+
+            // Watch every page the block was decoded from
+            auto [first_page, last_page] = block_pages(it->second);
+            for (unsigned int page = first_page; page <= last_page; page++) {
+                memory->mark_code_page(page);
+                page_blocks[page].push_back(key);
+            }
+        }
+
+        entry = {key, &it->second};
+        return it->second;
+    }
+
+    template <typename Bus>
+    std::pair<u8, u8> DecodeCache<Bus>::block_pages(const Block &instructions)
+    {
+        // Blocks end at a 16 KiB boundary, so the last page never wraps around
+        const DecodedInstruction &last = instructions.back();
+        return {instructions.front().address >> 8, (u16)(last.address + last.length - 1) >> 8};
+    }
+
+    template <typename Bus>
+    bool DecodeCache<Bus>::polling_loop(u16 address)
+    {
+        return find_block(address).front().polling_loop != 0;
+    }
+
+    template <typename Bus>
+    typename DecodeCache<Bus>::Block DecodeCache<Bus>::decode_block(u16 address) const
+    {
+        Block instructions;
+        u16 pc = address;
+        bool trapped = false;
+        do {
+            instructions.push_back(cpu->fetch(pc));
+            if (breakpoint(pc)) {
+                instructions.back().handler = &CPU<Bus>::trap;
+                trapped = true;
+            }
+            pc += instructions.back().length;
+        } while (!ends_block(instructions.back()) && instructions.size() < max_block_length &&
+                 pc >> 14 == address >> 14);
+        if (trapped) {
+            return instructions;
+        }
+#if defined(GAMEBOY_IDLE_SKIP)
+        mark_polling_loop(instructions);
+#endif
+#if !defined(GAMEBOY_DISPATCH_SWITCH) && !defined(GAMEBOY_HEATMAP)
+        if (fusion) {
+            fuse_block(instructions);
+        }
+#endif
+        return instructions;
+    }
+
+    template <typename Bus> void DecodeCache<Bus>::fuse_block(Block &instructions) const
+    {
+        // Each fused run collapses into its first entry, which covers all of its bytes
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < instructions.size();) {
+            std::size_t fused = cpu->fuse(&instructions[i], instructions.size() - i);
+            instructions[count++] = instructions[i];
+            i += fused;
+        }
+        instructions.resize(count);
+    }
+
+    template <typename Bus>
+    u32 DecodeCache<Bus>::block_key(u16 address) const
+    {
+        u32 bank = address >= 0x4000 && address < 0x8000 ? memory->rom_bank() : 0;
+        return bank << 16 | address;
+    }
+
+    template <typename Bus>
+    bool DecodeCache<Bus>::ends_block(const DecodedInstruction &instruction)
+    {
+        if (instruction.prefixed) {
+            return false;
+        }
+
+        // Unconditional control flow, conditional branches fall through into the block
+        switch (instruction.opcode) {
+            case 0x10: // STOP
+            case 0x18: // JR dd
+            case 0x76: // HALT
+            case 0xC3: // JP nn
+            case 0xC9: // RET
+            case 0xCD: // CALL nn
+            case 0xD9: // RETI
+            case 0xE9: // JP HL
+            case 0xC7:
+            case 0xCF:
+            case 0xD7:
+            case 0xDF:
+            case 0xE7:
+            case 0xEF:
+            case 0xF7:
+            case 0xFF: // RST n
+                return true;
+        }
+        return false;
+    }
+
+    template <typename Bus>
+    void DecodeCache<Bus>::mark_polling_loop(Block &instructions)
+    {
+        // Loops like LDH A,(44h); CP 90h; JR NZ that only read IO into A and test it. Every
+        // instruction is idempotent, so once an iteration completes the next one repeats it
+        // exactly until the IO register changes.
+        u16 head = instructions.front().address;
+        unsigned int cycles = 0;
+        for (DecodedInstruction &instruction : instructions) {
+            u8 op = instruction.opcode;
+            if (instruction.prefixed) {
+                // BIT n, A
+                if ((op & 0xC7) != 0x47) {
+                    return;
+                }
+                cycles += 8;
+                continue;
+            }
+
+            u16 target = instruction.address;
+            switch (op) {
+                case 0xF0: // LDH A, (n)
+                    cycles += 12;
+                    continue;
+                case 0xF2: // LD A, (C)
+                case 0xE6: // AND n
+                case 0xF6: // OR n
+                case 0xFE: // CP n
+                    cycles += 8;
+                    continue;
+                case 0xA7: // AND A
+                case 0xB7: // OR A
+                case 0xB8:
+                case 0xB9:
+                case 0xBA:
+                case 0xBB:
+                case 0xBC:
+                case 0xBD:
+                case 0xBF: // CP r
+                    cycles += 4;
+                    continue;
+                case 0x20:
+                case 0x28:
+                case 0x30:
+                case 0x38: // JR cc, dd
+                    target += instruction.length + (i8)instruction.operand;
+                    cycles += 12;
+                    break;
+                case 0xC2:
+                case 0xCA:
+                case 0xD2:
+                case 0xDA: // JP cc, nn
+                    target = instruction.operand;
+                    cycles += 16;
+                    break;
+                default: return;
+            }
+
+            if (target == head && cycles <= 0xFF) {
+                for (DecodedInstruction *body = &instructions.front(); body <= &instruction;
+                     body++) {
+                    body->polling_loop = (u8)cycles;
+                }
+            }
+            return;
+        }
+    }
+
+    template class DecodeCache<FlatBus>;
+    template class DecodeCache<MMU>;
+    template class DecodeCache<TracingBus<MMU>>;
+} // namespace Gameboy
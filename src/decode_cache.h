@@ -0,0 +1,100 @@
+#pragma once
+
+#include "code_cache.h"
+#include "cpu.h"
+#include "types.h"
+
+#include <array>
+#include <bitset>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Gameboy
+{
+    class JIT;
+
+    // Straight-line runs of decoded instructions, keyed by start address and ROM bank.
+    // Blocks are dropped when the memory they were decoded from is written.
+    template <typename Bus> class DecodeCache : public CodeCache
+    {
+      private:
+        typedef typename CPU<Bus>::DecodedInstruction DecodedInstruction;
+        typedef std::vector<DecodedInstruction> Block;
+
+        struct BlockLookup {
+            u32 key;
+            const Block *block;
+        };
+
+      public:
+        DecodeCache(const CPU<Bus> *cpu, Bus *memory);
+
+        const DecodedInstruction &fetch(u16 address)
+        {
+            // Continue through the current block while execution stays sequential
+            if (block && index < block->size() && (*block)[index].address == address) {
+                return (*block)[index++];
+            }
+            return fetch_block(address);
+        }
+
+        void invalidate_page(u8 page) override;
+        void switch_bank() override;
+        void lock_bus() override;
+        u32 block_key(u16 address) const;
+
+        // Bumped whenever blocks are dropped, so a superinstruction can tell its code changed
+        u32 generation() const { return invalidations; }
+
+        // Whether the block at address is a polling loop the CPU can skip
+        bool polling_loop(u16 address);
+
+        // Superinstructions, off when each instruction must be counted individually
+        void set_fusion(bool enabled) { fusion = enabled; }
+
+        // Instructions at a breakpoint decode to the CPU's trap, and their blocks are neither
+        // fused nor skipped as polling loops
+        void set_breakpoint(u16 address);
+        void clear_breakpoint(u16 address);
+        bool breakpoint(u16 address) const
+        {
+            return page_breakpoints[address >> 8] && breakpoints[address];
+        }
+
+#if defined(GAMEBOY_JIT)
+        void set_jit(JIT *compiler) { jit = compiler; }
+#endif
+
+      private:
+        const DecodedInstruction &fetch_block(u16 address);
+        const Block &find_block(u16 address);
+        Block decode_block(u16 address) const;
+        void fuse_block(Block &instructions) const;
+
+        static std::pair<u8, u8> block_pages(const Block &instructions);
+        static bool ends_block(const DecodedInstruction &instruction);
+        static void mark_polling_loop(Block &instructions);
+
+      private:
+        static constexpr std::size_t max_block_length = 64;
+        static constexpr std::size_t lookup_size = 1024;
+
+        std::unordered_map<u32, Block> blocks;
+        std::array<BlockLookup, lookup_size> lookup = {};
+        std::array<std::vector<u32>, 256> page_blocks;
+        const Block *block = nullptr;
+        std::size_t index = 0;
+        // What the CPU fetches outside page 0xFF during OAM DMA, never cached
+        DecodedInstruction locked_bus = {};
+        u32 invalidations = 0;
+        bool fusion = true;
+        std::bitset<0x10000> breakpoints;
+        std::array<u16, 256> page_breakpoints = {};
+        const CPU<Bus> *cpu;
+        Bus *memory;
+#if defined(GAMEBOY_JIT)
+        JIT *jit = nullptr;
+#endif
+    };
+} // namespace Gameboy
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "code_cache.h"
+#include "types.h"
+
+#include <array>
+
+namespace Gameboy
+{
+    // 64 KiB of plain RAM with no cartridge or IO behaviour, for tests and benchmarks
+    class FlatBus
+    {
+      public:
+        u8 read(u16 address) const { return memory[address]; }
+        u8 read_io(u8 offset) const { return memory[0xFF00 + offset]; }
+
+        void write(u16 address, u8 value)
+        {
+            memory[address] = value;
+            if (address == 0xFF0F || address == 0xFFFF) {
+                interrupts = memory[0xFFFF] & memory[0xFF0F] & 0x1F;
+            }
+            if (code_pages[address >> 8]) {
+                invalidate_code(address >> 8);
+            }
+        }
+        void write_io(u8 offset, u8 value) { write(0xFF00 + offset, value); }
+
+        u8 pending_interrupts() const { return interrupts; }
+        void request_interrupt(u8 interrupt) { write(0xFF0F, memory[0xFF0F] | 1 << interrupt); }
+
+        u16 rom_bank() const { return 1; }
+
+        void set_decode_cache(CodeCache *cache) { decode_cache = cache; }
+        void mark_code_page(u8 page) { code_pages[page] = true; }
+        bool dma_active() const { return false; }
+
+        // Everything below IO is plain memory
+        const u8 *read_span(u16 address, u16 length) const
+        {
+            return address + length <= 0xFF00 ? memory.data() + address : nullptr;
+        }
+        u8 *write_span(u16 address, u16 length)
+        {
+            if (address + length > 0xFF00) {
+                return nullptr;
+            }
+            for (u32 page = address >> 8; page <= (address + length - 1u) >> 8; page++) {
+                if (code_pages[page]) {
+                    return nullptr;
+                }
+            }
+            return memory.data() + address;
+        }
+
+      private:
+        void invalidate_code(u8 page)
+        {
+            code_pages[page] = false;
+            if (decode_cache) {
+                decode_cache->invalidate_page(page);
+            }
+        }
+
+      private:
+        std::array<u8, 0x10000> memory = {};
+        std::array<bool, 256> code_pages = {};
+        u8 interrupts = 0;
+        CodeCache *decode_cache = nullptr;
+    };
+} // namespace Gameboy
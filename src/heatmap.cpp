@@ -0,0 +1,51 @@
+#include "heatmap.h"
+
+#if defined(GAMEBOY_HEATMAP)
+
+#include <cstdio>
+
+namespace Gameboy
+{
+    void Heatmap::reset(std::size_t rom_size)
+    {
+        rom_length = (u32)rom_size;
+        for (std::vector<u64> &lines : counts) {
+            lines.assign((rom_size + 0x8000) / line_size, 0);
+        }
+    }
+
+    bool Heatmap::save(const char *path) const
+    {
+        std::FILE *file = std::fopen(path, "w");
+        if (!file) {
+            return false;
+        }
+
+        std::fprintf(file, "bank,address,reads,writes,executes\n");
+        const std::vector<u64> &reads = counts[(std::size_t)Access::Read];
+        const std::vector<u64> &writes = counts[(std::size_t)Access::Write];
+        const std::vector<u64> &executes = counts[(std::size_t)Access::Execute];
+        for (std::size_t line = 0; line < reads.size(); line++) {
+            if (!reads[line] && !writes[line] && !executes[line]) {
+                continue;
+            }
+            u32 location = (u32)line * line_size;
+            if (location < rom_length) {
+                // Bank 0 sits at 0x0000, every other bank at 0x4000
+                u32 bank = location / 0x4000;
+                std::fprintf(file, "%u,%04X", bank, (bank ? 0x4000 : 0) + location % 0x4000);
+            } else {
+                std::fprintf(file, ",%04X", 0x8000 + location - rom_length);
+            }
+            std::fprintf(
+                file,
+                ",%llu,%llu,%llu\n",
+                (unsigned long long)reads[line],
+                (unsigned long long)writes[line],
+                (unsigned long long)executes[line]);
+        }
+        return std::fclose(file) == 0;
+    }
+} // namespace Gameboy
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#if defined(GAMEBOY_HEATMAP)
+
+#include "types.h"
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#if !defined(GAMEBOY_HEATMAP_LINE)
+#define GAMEBOY_HEATMAP_LINE 16
+#endif
+
+namespace Gameboy
+{
+    // Read, write and execute counts per line of GAMEBOY_HEATMAP_LINE bytes. ROM is counted by
+    // its offset in the file, so every bank gets its own lines; 0x8000-0xFFFF follows it.
+    // Opcode bytes read while decoding a block show up as reads, once per decode.
+    class Heatmap
+    {
+      public:
+        enum class Access : u8 { Read, Write, Execute, Count };
+
+        static constexpr u32 line_size = GAMEBOY_HEATMAP_LINE;
+        static_assert((line_size & (line_size - 1)) == 0, "heatmap lines are a power of two");
+
+        // Clears the counts and makes room for a ROM of rom_size bytes
+        void reset(std::size_t rom_size);
+        u32 rom_size() const { return rom_length; }
+
+        void count(Access access, u32 location)
+        {
+            counts[(std::size_t)access][location / line_size]++;
+        }
+
+        // One CSV row per line that was touched: ROM bank (empty above 0x8000), bus address,
+        // then the read, write and execute counts. Returns false if the file can't be written.
+        bool save(const char *path) const;
+
+      private:
+        u32 rom_length = 0;
+        std::array<std::vector<u64>, (std::size_t)Access::Count> counts;
+    };
+} // namespace Gameboy
+
+#endif
@@ -0,0 +1,752 @@
+#include "jit.h"
+
+#if defined(GAMEBOY_JIT)
+
+#include "decode_cache.h"
+#include "mmu.h"
+
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+#define REG_HL 6
+
+// x86-64 registers used as byte/dword operands
+#define X_AL 0
+#define X_CL 1
+#define X_DL 2
+
+namespace Gameboy
+{
+    // Minimal x86-64 encoder for the instructions the JIT emits. While compiled code runs
+    // rbx holds the CPU pointer, r12d the cycle count, r13d the instruction count and
+    // r14d the cycle budget for chaining.
+    class Emitter
+    {
+      public:
+        Emitter(u8 *cursor) : cursor(cursor) {}
+
+        u8 *position() const { return cursor; }
+
+        void bytes(std::initializer_list<u8> values)
+        {
+            for (u8 value : values) {
+                *cursor++ = value;
+            }
+        }
+
+        void dword(u32 value)
+        {
+            std::memcpy(cursor, &value, sizeof(value));
+            cursor += sizeof(value);
+        }
+
+        void qword(u64 value)
+        {
+            std::memcpy(cursor, &value, sizeof(value));
+            cursor += sizeof(value);
+        }
+
+        // <opcode> reg, [rbx + offset]
+        void mem(std::initializer_list<u8> opcode, u8 reg, u32 offset)
+        {
+            bytes(opcode);
+            if (offset < 0x80) {
+                bytes({(u8)(0x43 | reg << 3), (u8)offset});
+            } else {
+                bytes({(u8)(0x83 | reg << 3)});
+                dword(offset);
+            }
+        }
+
+        // Emits a rel32 jump and returns the location of its displacement
+        u8 *jump(std::initializer_list<u8> opcode, const u8 *target)
+        {
+            bytes(opcode);
+            u8 *site = cursor;
+            dword(0);
+            patch(site, target);
+            return site;
+        }
+
+        static void patch(u8 *site, const u8 *target)
+        {
+            i32 displacement = (i32)(target - (site + 4));
+            std::memcpy(site, &displacement, sizeof(displacement));
+        }
+
+        void add_cycles(u32 cycles)
+        {
+            if (cycles) {
+                bytes({0x41, 0x81, 0xC4}); // add r12d, imm32
+                dword(cycles);
+            }
+        }
+
+        void add_instructions(u32 instructions)
+        {
+            if (instructions) {
+                bytes({0x41, 0x81, 0xC5}); // add r13d, imm32
+                dword(instructions);
+            }
+        }
+
+        // Converts the flags in AH (after lahf) into Game Boy Z, H and C, plus N
+        void store_flags(u32 offset, u8 n)
+        {
+            bytes({0x0F, 0xB6, 0xCC});       // movzx ecx, ah
+            bytes({0x89, 0xCA});             // mov edx, ecx
+            bytes({0x83, 0xE2, 0x50});       // and edx, ZF | AF
+            bytes({0xD1, 0xE2});             // shl edx, 1
+            bytes({0x83, 0xE1, 0x01});       // and ecx, CF
+            bytes({0xC1, 0xE1, 0x04});       // shl ecx, 4
+            bytes({0x09, 0xCA});             // or edx, ecx
+            if (n) {
+                bytes({0x83, 0xCA, n});      // or edx, n
+            }
+            mem({0x88}, X_DL, offset);       // mov [F], dl
+        }
+
+        // Z and H from AH, N as given, C kept from F
+        void store_flags_keep_carry(u32 offset, u8 n)
+        {
+            bytes({0x0F, 0xB6, 0xCC});       // movzx ecx, ah
+            bytes({0x83, 0xE1, 0x50});       // and ecx, ZF | AF
+            bytes({0xD1, 0xE1});             // shl ecx, 1
+            mem({0x8A}, X_DL, offset);       // mov dl, [F]
+            bytes({0x83, 0xE2, FLAG_C});     // and edx, FLAG_C
+            bytes({0x09, 0xCA});             // or edx, ecx
+            if (n) {
+                bytes({0x83, 0xCA, n});      // or edx, n
+            }
+            mem({0x88}, X_DL, offset);       // mov [F], dl
+        }
+
+        // Z from AH, the other flags as given
+        void store_flags_zero(u32 offset, u8 flags)
+        {
+            bytes({0x0F, 0xB6, 0xCC});       // movzx ecx, ah
+            bytes({0x83, 0xE1, 0x40});       // and ecx, ZF
+            bytes({0xD1, 0xE1});             // shl ecx, 1
+            if (flags) {
+                bytes({0x83, 0xC9, flags});  // or ecx, flags
+            }
+            mem({0x88}, X_CL, offset);       // mov [F], cl
+        }
+
+      private:
+        u8 *cursor;
+    };
+
+    JIT::JIT(CPU<MMU> *cpu, MMU *memory, bool lockstep) : cpu(cpu), memory(memory)
+    {
+#if defined(_WIN32)
+        code = (u8 *)VirtualAlloc(
+            nullptr, code_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (!code) {
+            throw std::bad_alloc();
+        }
+#else
+        void *mapping = mmap(
+            nullptr,
+            code_size,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0);
+        if (mapping == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        code = (u8 *)mapping;
+#endif
+        code_end = code + code_size;
+
+        Emitter e(code);
+
+        // u64 entry(CPU *cpu, u32 budget, const u8 *code)
+        entry = (EntryPoint)e.position();
+        e.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx, r12, r13, r14
+        e.bytes({0x48, 0x83, 0xEC, 0x28});                   // sub rsp, 40
+#if defined(_WIN32)
+        e.bytes({0x48, 0x89, 0xCB});                         // mov rbx, rcx
+        e.bytes({0x41, 0x89, 0xD6});                         // mov r14d, edx
+#else
+        e.bytes({0x48, 0x89, 0xFB});                         // mov rbx, rdi
+        e.bytes({0x41, 0x89, 0xF6});                         // mov r14d, esi
+#endif
+        e.bytes({0x45, 0x31, 0xE4});                         // xor r12d, r12d
+        e.bytes({0x45, 0x31, 0xED});                         // xor r13d, r13d
+#if defined(_WIN32)
+        e.bytes({0x41, 0xFF, 0xE0});                         // jmp r8
+#else
+        e.bytes({0xFF, 0xE2});                               // jmp rdx
+#endif
+
+        // Returns cycles | instructions << 32, PC has already been written back
+        exit = e.position();
+        e.bytes({0x44, 0x89, 0xE0});                         // mov eax, r12d
+        e.bytes({0x49, 0xC1, 0xE5, 0x20});                   // shl r13, 32
+        e.bytes({0x4C, 0x09, 0xE8});                         // or rax, r13
+        e.bytes({0x48, 0x83, 0xC4, 0x28});                   // add rsp, 40
+        e.bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B}); // pop r14, r13, r12, rbx
+        e.bytes({0xC3});                                     // ret
+
+        // Exit with the next PC returned by a handler in ax
+        dynamic_exit = e.position();
+        e.mem({0x66, 0x89}, X_AL, offset_of(cpu->pc));       // mov [pc], ax
+        e.jump({0xE9}, exit);
+
+        code_start = e.position();
+        cursor = code_start;
+
+        if (lockstep) {
+            // A cartridge is shared with the shadow, its RAM sees both CPUs' writes
+            shadow_memory = std::make_unique<MMU>();
+            if (memory->loaded_cartridge()) {
+                shadow_memory->load_cartridge(memory->loaded_cartridge());
+            } else {
+                std::array<u8, 0x8000> rom;
+                for (u32 address = 0; address < rom.size(); address++) {
+                    rom[address] = memory->read(address);
+                }
+                shadow_memory->load_rom(rom.data(), rom.size());
+            }
+            for (u32 address = 0x8000; address <= 0xFFFF; address++) {
+                shadow_memory->write(address, memory->read(address));
+            }
+            // Writing the DMA register above copied a page over OAM
+            for (u32 address = 0xFE00; address < 0xFEA0; address++) {
+                shadow_memory->write(address, memory->read(address));
+            }
+            shadow = std::make_unique<CPU<MMU>>(shadow_memory.get(), cpu->display);
+            shadow->decode_cache->set_fusion(false);
+            shadow->af = cpu->af;
+            shadow->bc = cpu->bc;
+            shadow->de = cpu->de;
+            shadow->hl = cpu->hl;
+            shadow->sp = cpu->sp;
+            shadow->pc = cpu->pc;
+            shadow->ime = cpu->ime;
+            shadow->halted = cpu->halted;
+            shadow->stopped = cpu->stopped;
+        }
+    }
+
+    JIT::~JIT()
+    {
+#if defined(_WIN32)
+        VirtualFree(code, 0, MEM_RELEASE);
+#else
+        munmap(code, code_size);
+#endif
+    }
+
+    unsigned int JIT::execute(u32 budget, unsigned int &instructions)
+    {
+        // ROM only, and not while OAM DMA locks it away from the CPU
+        u16 address = cpu->pc;
+        if (address >= 0x8000 || memory->dma_active()) {
+            return 0;
+        }
+
+        u32 key = cpu->decode_cache->block_key(address);
+        BlockLookup &entry_lookup = lookup[address % lookup_size];
+        Block *block = entry_lookup.block && entry_lookup.key == key ? entry_lookup.block : nullptr;
+        if (!block) {
+            block = &blocks[key];
+            entry_lookup = {key, block};
+        }
+
+        if (!block->code) {
+            if (block->uncompilable || ++block->hits < compile_threshold) {
+                return 0;
+            }
+#if defined(GAMEBOY_IDLE_SKIP)
+            // Polling loops stay in the interpreter, which skips them instead. The CPU also keeps
+            // away from the JIT until it leaves the loop body.
+            if (cpu->decode_cache->polling_loop(address)) {
+                block->uncompilable = true;
+                return 0;
+            }
+#endif
+            if ((std::size_t)(code_end - cursor) < max_block_code) {
+                flush();
+                block = &blocks[key];
+                lookup[address % lookup_size] = {key, block};
+            }
+            block->code = compile(address, key, *block);
+            if (!block->code) {
+                block->uncompilable = true;
+                return 0;
+            }
+        }
+
+        // Compiled code reads and writes F directly
+        cpu->materialize_flags();
+        last_address = address;
+        u64 result = entry(cpu, budget, block->code);
+        instructions = (unsigned int)(result >> 32);
+        return (unsigned int)result;
+    }
+
+    void JIT::invalidate_page(u8 page)
+    {
+        for (u32 key : page_blocks[page]) {
+            auto it = blocks.find(key);
+            if (it == blocks.end()) {
+                continue;
+            }
+
+            // Send chained jumps back through the dispatcher until it is recompiled
+            if (it->second.valid) {
+                *it->second.valid = 0;
+            }
+            std::vector<u8 *> &pending = pending_links[key];
+            for (u8 *site : it->second.incoming) {
+                Emitter::patch(site, exit);
+                pending.push_back(site);
+            }
+            // The other pages of a block across two must not keep its key
+            for (u32 other = it->second.first_page; other <= it->second.last_page; other++) {
+                if (other != page) {
+                    std::erase(page_blocks[other], key);
+                }
+            }
+            blocks.erase(it);
+        }
+        page_blocks[page].clear();
+        lookup.fill({});
+    }
+
+    const u8 *JIT::compile(u16 address, u32 key, Block &block)
+    {
+        // The block's valid flag lives in front of its code so it outlives the Block
+        block.valid = cursor;
+        *block.valid = 1;
+        Emitter e(cursor + 1);
+        u8 *start = e.position();
+        const u32 f = offset_of(cpu->af.lo());
+        const u32 a = offset_of(cpu->af.hi());
+        const u32 ime = offset_of(reinterpret_cast<const u8 &>(cpu->ime));
+
+        // Cycles and instructions of natively compiled code not yet added to r12d/r13d
+        u32 pending_cycles = 0;
+        u32 pending_instructions = 0;
+
+        auto flush_pending = [&]() {
+            e.add_cycles(pending_cycles);
+            e.add_instructions(pending_instructions);
+            pending_cycles = 0;
+            pending_instructions = 0;
+        };
+
+        // Leave the block for a known address, chaining to its block when possible
+        auto static_exit = [&](u16 target, u32 cycles, u32 instructions) {
+            e.add_cycles(cycles);
+            e.add_instructions(instructions);
+            e.mem({0x66, 0xC7}, 0, offset_of(cpu->pc)); // mov word [pc], imm16
+            e.bytes({(u8)target, (u8)(target >> 8)});
+            e.bytes({0x45, 0x39, 0xF4});                // cmp r12d, r14d
+            e.jump({0x0F, 0x83}, exit);                 // jae exit
+            u8 *site = e.jump({0xE9}, exit);            // jmp exit (patched when chained)
+
+            bool same_region = target >> 14 == address >> 14;
+            if (target < 0x4000 || (target < 0x8000 && same_region)) {
+                link(cpu->decode_cache->block_key(target), site);
+            }
+        };
+
+        u16 pc = address;
+        std::size_t count = 0;
+        bool open = true;
+        while (open && count < max_block_length && pc >> 14 == address >> 14) {
+            CPU<MMU>::DecodedInstruction instruction = cpu->fetch(pc);
+            u8 op = instruction.opcode;
+            u16 next = pc + instruction.length;
+
+            // Interrupt state changes and breakpoints are left to the interpreter
+            if (!instruction.prefixed &&
+                (op == 0x10 || op == 0x76 || op == 0xD9 || op == 0xF3 || op == 0xFB)) {
+                break;
+            }
+            if (cpu->decode_cache->breakpoint(pc)) {
+                break;
+            }
+            count++;
+
+            u8 x = op >> 6;
+            u8 y = (op >> 3) & 7;
+            u8 z = op & 7;
+            bool alu_r = x == 2 && z != REG_HL;
+            bool alu_n = x == 3 && z == 6;
+
+            if (instruction.prefixed) {
+                // Fall through to the handler call below
+            } else if (op == 0x00) {
+                pending_cycles += 4;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (x == 1 && y != REG_HL && z != REG_HL) {
+                // LD r, r'
+                e.mem({0x8A}, X_AL, offset_of(register8(z)));
+                e.mem({0x88}, X_AL, offset_of(register8(y)));
+                pending_cycles += 4;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (x == 0 && z == 6 && y != REG_HL) {
+                // LD r, n
+                e.mem({0xC6}, 0, offset_of(register8(y)));
+                e.bytes({(u8)instruction.operand});
+                pending_cycles += 8;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (x == 0 && z == 1 && !(y & 1)) {
+                // LD rr, nn
+                CPU<MMU>::Register16 &rr = register16(y >> 1);
+                e.mem({0x66, 0xC7}, 0, offset_of(rr)); // mov word [rr], imm16
+                e.bytes({(u8)instruction.operand, (u8)(instruction.operand >> 8)});
+                pending_cycles += 12;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (x == 0 && z == 3) {
+                // INC rr, DEC rr
+                CPU<MMU>::Register16 &rr = register16(y >> 1);
+                e.mem({0x66, 0xFF}, y & 1, offset_of(rr)); // inc/dec word [rr]
+                pending_cycles += 8;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (x == 0 && (z == 4 || z == 5) && y != REG_HL) {
+                // INC r, DEC r
+                e.mem({0xFE}, z == 4 ? 0 : 1, offset_of(register8(y)));
+                e.bytes({0x9F}); // lahf
+                e.store_flags_keep_carry(f, z == 4 ? 0 : FLAG_N);
+                pending_cycles += 4;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (alu_r || alu_n) {
+                // ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+                static const u8 mem_opcodes[] = {0x02, 0x12, 0x2A, 0x1A, 0x22, 0x32, 0x0A, 0x3A};
+                static const u8 imm_opcodes[] = {0x04, 0x14, 0x2C, 0x1C, 0x24, 0x34, 0x0C, 0x3C};
+                e.mem({0x8A}, X_AL, a); // mov al, [A]
+                if (y == 1 || y == 3) {
+                    e.mem({0x8A}, X_CL, f);      // mov cl, [F]
+                    e.bytes({0xC0, 0xE1, 0x04}); // shl cl, 4 (carry into CF)
+                }
+                if (alu_r) {
+                    e.mem({mem_opcodes[y]}, X_AL, offset_of(register8(z)));
+                } else {
+                    e.bytes({imm_opcodes[y], (u8)instruction.operand});
+                }
+                e.bytes({0x9F}); // lahf
+                if (y != 7) {
+                    e.mem({0x88}, X_AL, a); // mov [A], al
+                }
+                switch (y) {
+                    case 0:
+                    case 1: e.store_flags(f, 0); break;
+                    case 2:
+                    case 3:
+                    case 7: e.store_flags(f, FLAG_N); break;
+                    case 4: e.store_flags_zero(f, FLAG_H); break;
+                    default: e.store_flags_zero(f, 0); break;
+                }
+                pending_cycles += alu_r ? 4 : 8;
+                pending_instructions++;
+                pc = next;
+                continue;
+            } else if (op == 0x18 || op == 0xC3) {
+                // JR dd, JP nn
+                u16 target = op == 0x18 ? (u16)(next + (i8)instruction.operand)
+                                        : instruction.operand;
+                static_exit(
+                    target, pending_cycles + (op == 0x18 ? 12 : 16), pending_instructions + 1);
+                open = false;
+                pc = next;
+                break;
+            } else if ((x == 0 && z == 0 && y >= 4) || (x == 3 && z == 2 && y < 4)) {
+                // JR cc, dd and JP cc, nn
+                bool relative = x == 0;
+                u16 target =
+                    relative ? (u16)(next + (i8)instruction.operand) : instruction.operand;
+                u8 mask = (y & 2) ? FLAG_C : FLAG_Z;
+                bool value = y & 1;
+                pending_instructions++;
+
+                e.mem({0xF6}, 0, f); // test byte [F], mask
+                e.bytes({mask});
+                u8 *skip = e.jump({0x0F, (u8)(value ? 0x84 : 0x85)}, exit);
+                static_exit(target, pending_cycles + (relative ? 12 : 16), pending_instructions);
+                Emitter::patch(skip, e.position());
+
+                pending_cycles += relative ? 8 : 12;
+                pc = next;
+                continue;
+            }
+
+            // Everything else runs the interpreter's handler
+            pending_instructions++;
+            flush_pending();
+#if defined(_WIN32)
+            e.bytes({0x48, 0x89, 0xD9}); // mov rcx, rbx
+            e.bytes({0x48, 0xBA});       // mov rdx, handler
+            e.qword((u64)instruction.handler);
+            e.bytes({0x41, 0xB8}); // mov r8d, state
+#else
+            e.bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+            e.bytes({0x48, 0xBE});       // mov rsi, handler
+            e.qword((u64)instruction.handler);
+            e.bytes({0xBA}); // mov edx, state
+#endif
+            e.dword((u32)pc | (u32)instruction.operand << 16);
+            e.bytes({0x48, 0xB8}); // mov rax, execute_handler
+            e.qword((u64)&execute_handler);
+            e.bytes({0xFF, 0xD0});       // call rax
+            e.bytes({0x89, 0xC1});       // mov ecx, eax
+            e.bytes({0xC1, 0xE9, 0x10}); // shr ecx, 16
+            e.bytes({0x41, 0x01, 0xCC}); // add r12d, ecx
+
+            // Leave at the next PC, still in ax, if the handler's writes requested or enabled
+            // an interrupt that IME lets in
+            e.bytes({0x48, 0xB9}); // mov rcx, mask
+            e.qword((u64)memory->pending_interrupts_mask());
+            e.bytes({0x80, 0x39, 0x00});                   // cmp byte [rcx], 0
+            u8 *none_pending = e.jump({0x0F, 0x84}, exit); // je (patched past the exit)
+            e.mem({0x80}, 7, ime);                         // cmp byte [ime], 0
+            e.bytes({0x00});
+            e.jump({0x0F, 0x85}, dynamic_exit); // jne
+            Emitter::patch(none_pending, e.position());
+
+            if (!instruction.prefixed) {
+                switch (op) {
+                    case 0xC9: // RET
+                    case 0xE9: // JP HL
+                        e.jump({0xE9}, dynamic_exit);
+                        open = false;
+                        break;
+                    case 0xCD: // CALL nn
+                        static_exit(instruction.operand, 0, 0);
+                        open = false;
+                        break;
+                    case 0xC7:
+                    case 0xCF:
+                    case 0xD7:
+                    case 0xDF:
+                    case 0xE7:
+                    case 0xEF:
+                    case 0xF7:
+                    case 0xFF: // RST n
+                        static_exit(op & 0x38, 0, 0);
+                        open = false;
+                        break;
+                    case 0xC0:
+                    case 0xC4:
+                    case 0xC8:
+                    case 0xCC:
+                    case 0xD0:
+                    case 0xD4:
+                    case 0xD8:
+                    case 0xDC: // RET cc, CALL cc
+                        e.bytes({0x66, 0x3D});    // cmp ax, imm16
+                        e.bytes({(u8)next, (u8)(next >> 8)});
+                        e.jump({0x0F, 0x85}, dynamic_exit); // jne
+                        break;
+                }
+            }
+
+            // Leave if the handler's writes invalidated this block
+            if (open) {
+                e.bytes({0x48, 0xB9}); // mov rcx, valid
+                e.qword((u64)block.valid);
+                e.bytes({0x80, 0x39, 0x00});        // cmp byte [rcx], 0
+                e.jump({0x0F, 0x84}, dynamic_exit); // je
+            }
+            pc = next;
+        }
+
+        if (count == 0) {
+            // Retried once the page changes, which is also how a breakpoint is cleared
+            block.valid = nullptr;
+            block.first_page = block.last_page = address >> 8;
+            page_blocks[address >> 8].push_back(key);
+            return nullptr;
+        }
+        if (open) {
+            static_exit(pc, pending_cycles, pending_instructions);
+        }
+        cursor = e.position();
+
+        // Watch the pages the block was compiled from
+        block.first_page = address >> 8;
+        block.last_page = (u16)(pc - 1) >> 8;
+        for (u32 page = block.first_page; page <= block.last_page; page++) {
+            memory->mark_code_page(page);
+            page_blocks[page].push_back(key);
+        }
+
+        // Resolve jumps that were waiting for this block
+        auto pending = pending_links.find(key);
+        if (pending != pending_links.end()) {
+            for (u8 *site : pending->second) {
+                Emitter::patch(site, start);
+                block.incoming.push_back(site);
+            }
+            pending_links.erase(pending);
+        }
+        return start;
+    }
+
+    void JIT::link(u32 target, u8 *site)
+    {
+        auto it = blocks.find(target);
+        if (it != blocks.end() && it->second.code) {
+            Emitter::patch(site, it->second.code);
+            it->second.incoming.push_back(site);
+        } else {
+            pending_links[target].push_back(site);
+        }
+    }
+
+    void JIT::flush()
+    {
+        cursor = code_start;
+        blocks.clear();
+        pending_links.clear();
+        for (auto &keys : page_blocks) {
+            keys.clear();
+        }
+        lookup.fill({});
+    }
+
+    void JIT::step_shadow(unsigned int instructions, unsigned int cycles)
+    {
+        unsigned int shadow_cycles = 0;
+        if (shadow->halted && !shadow->wake()) {
+            // Idle steps have no length of their own, they last until the caller's next event
+            shadow_cycles = cycles;
+        } else {
+            // A step stopped at a breakpoint ran nothing
+            if (cpu->breakpoint_hit == cpu->pc) {
+                instructions = 0;
+            }
+            // Interrupts are taken after the instruction that made them pending, compiled code
+            // has to leave the block there too
+            for (unsigned int i = 0; i + 1 < instructions; i++) {
+                shadow_cycles += shadow->interpret();
+                if (auto interrupt = shadow->check_interrupts()) {
+                    shadow_cycles += shadow->interrupt_service_routine(*interrupt);
+                }
+            }
+            if (instructions) {
+                shadow_cycles += shadow->interpret();
+            }
+            if (auto interrupt = shadow->check_interrupts()) {
+                shadow_cycles += shadow->interrupt_service_routine(*interrupt);
+            }
+        }
+        cpu->materialize_flags();
+        shadow->materialize_flags();
+
+        bool match = shadow_cycles == cycles && shadow->af == cpu->af && shadow->bc == cpu->bc &&
+                     shadow->de == cpu->de && shadow->hl == cpu->hl && shadow->sp == cpu->sp &&
+                     shadow->pc == cpu->pc && shadow->ime == cpu->ime &&
+                     shadow->halted == cpu->halted && shadow->stopped == cpu->stopped;
+        if (match) {
+            return;
+        }
+
+        mismatches++;
+        std::fprintf(
+            stderr,
+            "JIT lockstep mismatch in block %04X (JIT/interpreter): "
+            "AF %04X/%04X BC %04X/%04X DE %04X/%04X HL %04X/%04X SP %04X/%04X PC %04X/%04X "
+            "cycles %u/%u\n",
+            last_address,
+            (u16)cpu->af,
+            (u16)shadow->af,
+            (u16)cpu->bc,
+            (u16)shadow->bc,
+            (u16)cpu->de,
+            (u16)shadow->de,
+            (u16)cpu->hl,
+            (u16)shadow->hl,
+            (u16)cpu->sp,
+            (u16)shadow->sp,
+            (u16)cpu->pc,
+            (u16)shadow->pc,
+            cycles,
+            shadow_cycles);
+
+        // Resynchronise so one divergence is reported once
+        shadow->af = cpu->af;
+        shadow->bc = cpu->bc;
+        shadow->de = cpu->de;
+        shadow->hl = cpu->hl;
+        shadow->sp = cpu->sp;
+        shadow->pc = cpu->pc;
+        shadow->ime = cpu->ime;
+        shadow->halted = cpu->halted;
+        shadow->stopped = cpu->stopped;
+    }
+
+    u32 JIT::offset_of(const u8 &field) const
+    {
+        return (u32)(&field - reinterpret_cast<const u8 *>(cpu));
+    }
+
+    u32 JIT::offset_of(const CPU<MMU>::Register16 &reg) const
+    {
+        return offset_of(reinterpret_cast<const u8 &>(reg));
+    }
+
+    u8 &JIT::register8(u8 index) const
+    {
+        switch (index) {
+            case 0: return cpu->bc.hi();
+            case 1: return cpu->bc.lo();
+            case 2: return cpu->de.hi();
+            case 3: return cpu->de.lo();
+            case 4: return cpu->hl.hi();
+            case 5: return cpu->hl.lo();
+        }
+        return cpu->af.hi();
+    }
+
+    CPU<MMU>::Register16 &JIT::register16(u8 index) const
+    {
+        switch (index) {
+            case 0: return cpu->bc;
+            case 1: return cpu->de;
+            case 2: return cpu->hl;
+        }
+        return cpu->sp;
+    }
+
+    u32 JIT::execute_handler(CPU<MMU> *cpu, CPU<MMU>::Handler handler, u32 state)
+    {
+        cpu->pc = (u16)state;
+        cpu->operand = (u16)(state >> 16);
+        CPU<MMU>::ExecuteResult result = handler(*cpu);
+        cpu->materialize_flags();
+        return result.next_pc | result.cycles << 16;
+    }
+} // namespace Gameboy
+
+#endif
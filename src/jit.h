@@ -0,0 +1,101 @@
+#pragma once
+
+#if defined(GAMEBOY_JIT)
+
+#include "cpu.h"
+#include "types.h"
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace Gameboy
+{
+    class MMU;
+
+    // Translates hot ROM basic blocks into x86-64. Register-only instructions are emitted
+    // natively, everything else calls the interpreter's handler for that opcode, and
+    // instructions that change interrupt state are left to CPU::step() entirely.
+    class JIT
+    {
+      private:
+        typedef u64 (*EntryPoint)(CPU<MMU> *cpu, u32 budget, const u8 *code);
+
+        struct Block {
+            const u8 *code = nullptr;
+            u8 *valid = nullptr;
+            unsigned int hits = 0;
+            bool uncompilable = false;
+            u8 first_page = 0;
+            u8 last_page = 0;
+            std::vector<u8 *> incoming;
+        };
+
+        struct BlockLookup {
+            u32 key;
+            Block *block;
+        };
+
+      public:
+        JIT(CPU<MMU> *cpu, MMU *memory, bool lockstep);
+        ~JIT();
+
+        // Runs compiled code from the current PC, chaining blocks until budget cycles have run.
+        // Returns 0 if the interpreter must step.
+        unsigned int execute(u32 budget, unsigned int &instructions);
+        void invalidate_page(u8 page);
+
+        // Replays the last step on the shadow interpreter and compares register state
+        void check_lockstep(unsigned int instructions, unsigned int cycles)
+        {
+            if (shadow) {
+                step_shadow(instructions, cycles);
+            }
+        }
+        u64 lockstep_mismatches() const { return mismatches; }
+
+      private:
+        const u8 *compile(u16 address, u32 key, Block &block);
+        void link(u32 target, u8 *site);
+        void flush();
+        void step_shadow(unsigned int instructions, unsigned int cycles);
+
+        u32 offset_of(const u8 &field) const;
+        u32 offset_of(const CPU<MMU>::Register16 &reg) const;
+        u8 &register8(u8 index) const;
+        CPU<MMU>::Register16 &register16(u8 index) const;
+
+        static u32 execute_handler(CPU<MMU> *cpu, CPU<MMU>::Handler handler, u32 state);
+
+      private:
+        static constexpr std::size_t code_size = 4 * 1024 * 1024;
+        static constexpr std::size_t max_block_code = 16 * 1024;
+        static constexpr std::size_t max_block_length = 64;
+        static constexpr std::size_t lookup_size = 1024;
+        static constexpr unsigned int compile_threshold = 16;
+
+        u8 *code;
+        u8 *code_start;
+        u8 *code_end;
+        u8 *cursor;
+        EntryPoint entry;
+        const u8 *exit;
+        const u8 *dynamic_exit;
+
+        std::unordered_map<u32, Block> blocks;
+        std::unordered_map<u32, std::vector<u8 *>> pending_links;
+        std::array<std::vector<u32>, 256> page_blocks;
+        std::array<BlockLookup, lookup_size> lookup = {};
+
+        CPU<MMU> *cpu;
+        MMU *memory;
+
+        std::unique_ptr<MMU> shadow_memory;
+        std::unique_ptr<CPU<MMU>> shadow;
+        u16 last_address = 0;
+        u64 mismatches = 0;
+    };
+} // namespace Gameboy
+
+#endif
@@ -1,16 +1,194 @@
+#include "bench.h"
+#include "cartridge.h"
+#include "check.h"
 #include "cpu.h"
 #include "display.h"
 #include "mmu.h"
+#include "ppu.h"
+#include "scheduler.h"
 
 #include <GLFW/glfw3.h>
 
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
 using namespace Gameboy;
 
+// 154 lines of 456 cycles
+static constexpr u64 cycles_per_frame = 70224;
+
+#if defined(GAMEBOY_HEATMAP)
+// Set by SIGUSR1, the heatmap is written between frames rather than from the handler
+static volatile std::sig_atomic_t heatmap_requested = 0;
+
+static void save_heatmap(const MMU &memory, const std::string &path)
+{
+    if (memory.heatmap().save(path.c_str())) {
+        std::fprintf(stderr, "heatmap written to %s\n", path.c_str());
+    } else {
+        std::fprintf(stderr, "cannot write heatmap to %s\n", path.c_str());
+    }
+}
+
+// Called between frames by both the windowed and the headless loop
+static void poll_heatmap_request(const MMU &memory, const std::string &path)
+{
+    if (heatmap_requested) {
+        heatmap_requested = 0;
+        save_heatmap(memory, path);
+    }
+}
+#endif
+
+// FNV-1a over the shades, to compare runs frame by frame
+static u64 hash_frame(const PPU::Frame &frame)
+{
+    u64 hash = 0xCBF29CE484222325;
+    for (u8 shade : frame) {
+        hash = (hash ^ shade) * 0x100000001B3;
+    }
+    return hash;
+}
+
+// On stderr, so headless runs keep only frame hashes on stdout
+static void print_stats(const CPU<MMU> &cpu)
+{
+    for (std::size_t i = 0; i < cpu.fusion_stats().size(); i++) {
+        auto fusion = (CPU<MMU>::Fusion)i;
+        std::fprintf(stderr, "%s: %llu\n", cpu.fusion_name(fusion),
+                     (unsigned long long)cpu.fusion_stats()[i]);
+    }
+#if defined(GAMEBOY_IDLE_SKIP)
+    std::fprintf(
+        stderr, "idle cycles skipped: %llu\n", (unsigned long long)cpu.idle_cycles_skipped());
+#endif
+}
+
+// Benchmarks that need no ROM, each run as the only argument
+struct Benchmark {
+    const char *flag;
+    void (*run)();
+};
+static const Benchmark benchmarks[] = {
+    {"--bench-pixels", Bench::pixels},
+    {"--bench-banking", Bench::banking},
+    {"--bench-dispatch", Bench::dispatch},
+    {"--bench-flags", Bench::flags},
+    {"--bench-instructions", Bench::instructions},
+    {"--bench-interrupts", Bench::interrupts},
+};
+
+// Self-checks, run the same way, exit with 1 on failure
+struct SelfCheck {
+    const char *flag;
+    bool (*run)();
+};
+static const SelfCheck checks[] = {
+    {"--check-dma", Check::dma},
+    {"--check-fusion", Check::fusion},
+    {"--check-idle-skip", Check::idle_skip},
+#if defined(GAMEBOY_JIT)
+    {"--check-jit-lockstep", Check::jit_lockstep},
+#endif
+    {"--check-save-file", Check::save_file},
+    {"--check-watchpoints", Check::watchpoints},
+};
+
+static int usage(const char *program)
+{
+    std::fprintf(stderr,
+                 "usage: %s [--fifo] [--frame-hashes <frames>] <rom>\n"
+                 "       %s --bench-<pixels|banking|dispatch|flags|instructions|interrupts>\n"
+                 "       %s --check-<dma|fusion|idle-skip|jit-lockstep|save-file|watchpoints>\n"
+                 "  --fifo            draw with the dot-accurate pixel FIFO\n"
+                 "  --frame-hashes    run headless and print a hash of every frame\n",
+                 program, program, program);
+    return 1;
+}
+
 int main(int argc, char** argv)
 {
+    for (const Benchmark &benchmark : benchmarks) {
+        if (argc == 2 && std::strcmp(argv[1], benchmark.flag) == 0) {
+            benchmark.run();
+            return 0;
+        }
+    }
+    for (const SelfCheck &check : checks) {
+        if (argc == 2 && std::strcmp(argv[1], check.flag) == 0) {
+            return check.run() ? 0 : 1;
+        }
+    }
+
+    auto renderer = PPU::Renderer::Scanline;
+    unsigned long hashed_frames = 0;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--fifo") == 0) {
+            renderer = PPU::Renderer::Fifo;
+        } else if (std::strcmp(argv[i], "--frame-hashes") == 0 && i + 1 < argc) {
+            hashed_frames = std::strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!path) {
+        return usage(argv[0]);
+    }
+
+    std::unique_ptr<Cartridge> cartridge;
+    try {
+        cartridge = std::make_unique<Cartridge>(path);
+    } catch (const std::runtime_error &error) {
+        std::fprintf(stderr, "%s: %s\n", path, error.what());
+        return 1;
+    }
+
     Display display;
+    Scheduler scheduler;
     MMU memory;
-    CPU cpu(&memory, &display);
+    memory.load_cartridge(cartridge.get());
+    memory.set_scheduler(&scheduler);
+    PPU ppu(&memory, &scheduler, renderer);
+    CPU<MMU> cpu(&memory, &display);
+#if defined(GAMEBOY_JIT)
+    cpu.enable_jit();
+#endif
+
+#if defined(GAMEBOY_HEATMAP)
+    std::string heatmap_path = std::string(path) + ".heatmap.csv";
+#if defined(SIGUSR1)
+    std::signal(SIGUSR1, [](int) { heatmap_requested = 1; });
+#endif
+#endif
+
+    // Every way out once the machine has run
+    auto finish = [&]() {
+#if defined(GAMEBOY_HEATMAP)
+        save_heatmap(memory, heatmap_path);
+#endif
+        print_stats(cpu);
+    };
+
+    // Both renderers end a frame on the same cycle, so their hashes line up frame for frame
+    if (hashed_frames) {
+        for (unsigned long frame = 0; frame < hashed_frames; frame++) {
+            scheduler.run(cpu, scheduler.now() + cycles_per_frame);
+            std::printf("%lu %016llx\n", frame, (unsigned long long)hash_frame(ppu.frame()));
+#if defined(GAMEBOY_HEATMAP)
+            poll_heatmap_request(memory, heatmap_path);
+#endif
+        }
+        finish();
+        return 0;
+    }
 
     glfwInit();
 
@@ -20,8 +198,13 @@ int main(int argc, char** argv)
     glfwShowWindow(window);
 
     while (!glfwWindowShouldClose(window)) {
+        scheduler.run(cpu, scheduler.now() + cycles_per_frame);
         glfwPollEvents();
+#if defined(GAMEBOY_HEATMAP)
+        poll_heatmap_request(memory, heatmap_path);
+#endif
     }
 
     glfwDestroyWindow(window);
+    finish();
 }
\ No newline at end of file
@@ -1,6 +1,669 @@
 #include "mmu.h"
 
+#include "cartridge.h"
+#include "code_cache.h"
+#include "ppu.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstring>
+
 namespace Gameboy
 {
-    MMU::MMU() : memory(new u8[0xFFFF]) {}
+    constexpr std::array<MMU::IoPort, 0x80> MMU::io_ports = [] {
+        std::array<IoPort, 0x80> ports = {};
+        auto port = [&](u8 offset, u8 unused, u8 writable, IoWrite write = nullptr) {
+            ports[offset] = {unused, writable, write};
+        };
+
+        // Nothing drives the buttons yet, they read as released
+        port(0x00, 0xCF, 0x30);
+        port(0x01, 0x00, 0xFF);
+        port(0x02, 0x7E, 0x81);
+        port(0x04, 0x00, 0x00, &MMU::write_divider);
+        port(0x05, 0x00, 0xFF);
+        port(0x06, 0x00, 0xFF);
+        port(0x07, 0xF8, 0x07);
+        port(0x0F, 0xE0, 0x1F, &MMU::write_interrupt_flags);
+
+        // Sound registers: write-only bits read as 1 and are only seen by the handler
+        constexpr u8 sound_unused[0x17] = {
+            0x80, 0x3F, 0x00, 0xFF, 0xBF,  // NR10-NR14
+            0xFF, 0x3F, 0x00, 0xFF, 0xBF,  // NR21-NR24
+            0x7F, 0xFF, 0x9F, 0xFF, 0xBF,  // NR30-NR34
+            0xFF, 0xFF, 0x00, 0x00, 0xBF,  // NR41-NR44
+            0x00, 0x00, 0x70,              // NR50-NR52
+        };
+        for (u8 offset = 0x10; offset < 0x26; offset++) {
+            if (offset != 0x15 && offset != 0x1F) {
+                u8 unused = sound_unused[offset - 0x10];
+                port(offset, unused, ~unused, &MMU::write_sound);
+            }
+        }
+        port(0x26, 0x70, 0x80, &MMU::write_sound_control);
+        for (u8 offset = 0x30; offset < 0x40; offset++) {
+            port(offset, 0x00, 0xFF);
+        }
+
+        port(0x40, 0x00, 0xFF, &MMU::write_lcd_control);
+        // STAT mode and coincidence bits, and LY, belong to the PPU
+        port(0x41, 0x80, 0x78);
+        for (u8 offset = 0x42; offset < 0x4C; offset++) {
+            port(offset, 0x00, offset == 0x44 ? 0x00 : 0xFF);
+        }
+        // Scroll, palettes and the window position, which the pixel FIFO reads as it goes
+        for (u8 offset : {0x42, 0x43, 0x47, 0x48, 0x49, 0x4A, 0x4B}) {
+            port(offset, 0x00, 0xFF, &MMU::write_lcd_register);
+        }
+        port(0x46, 0x00, 0xFF, &MMU::write_dma);
+        return ports;
+    }();
+
+    MMU::MMU()
+    {
+#if defined(GAMEBOY_HEATMAP)
+        access_counts.reset(rom.size());
+#endif
+        for (std::size_t offset = 0; offset < io_ports.size(); offset++) {
+            io[offset] = io_ports[offset].unused;
+        }
+
+        map(0x00, 0x7F, Region::Rom, rom.data());
+        // VRAM is written through the PPU's tile and tile map caches
+        map(0x80, 0x9F, Region::Vram, vram.data());
+        map(0xA0, 0xBF, Region::Memory, external_ram.data());
+        map(0xC0, 0xDF, Region::Memory, wram.data());
+        map(0xE0, 0xFD, Region::Memory, wram.data());
+        map(0xFE, 0xFE, Region::Oam, nullptr);
+        map(0xFF, 0xFF, Region::Io, nullptr);
+    }
+
+    void MMU::map(u8 first, u8 last, Region region, const u8 *memory)
+    {
+        for (unsigned int page = first; page <= last; page++) {
+            u8 *host = memory ? const_cast<u8 *>(memory) + (page - first) * 0x100 : nullptr;
+            host_pages[page] = host;
+            regions[page] = region;
+            update_page(page);
+        }
+    }
+
+    void MMU::update_page(u8 page)
+    {
+        // ROM is never written through its read pointer, only Memory pages get a write pointer
+        u8 *host = host_pages[page];
+        if (dma.active) {
+            read_pages[page] = nullptr;
+            write_pages[page] = nullptr;
+            return;
+        }
+        read_pages[page] = watched_pages[page] & watch_read ? nullptr : host;
+        bool writable = regions[page] == Region::Memory && !code_pages[code_page(page)] &&
+                        !(watched_pages[page] & watch_write);
+        write_pages[page] = writable ? host : nullptr;
+    }
+
+    void MMU::load_cartridge(Cartridge *new_cartridge)
+    {
+        cartridge = new_cartridge;
+        banks = {};
+#if defined(GAMEBOY_HEATMAP)
+        access_counts.reset(cartridge->header().rom_banks * Cartridge::rom_bank_size);
+#endif
+        map(0x00, 0x7F, Region::Rom, nullptr);
+        map_rom(true);
+        map_ram();
+        invalidate_code(0x00, 0x7F);
+    }
+
+    void MMU::load_rom(const u8 *data, std::size_t size)
+    {
+        cartridge = nullptr;
+        banks = {};
+#if defined(GAMEBOY_HEATMAP)
+        access_counts.reset(rom.size());
+#endif
+        std::memcpy(rom.data(), data, std::min(size, rom.size()));
+        map(0x00, 0x7F, Region::Rom, rom.data());
+        map(0xA0, 0xBF, Region::Memory, external_ram.data());
+        invalidate_code(0x00, 0x7F);
+        invalidate_code(0xA0, 0xBF);
+    }
+
+    void MMU::set_scheduler(Scheduler *new_scheduler)
+    {
+        scheduler = new_scheduler;
+        scheduler->set_callback(Scheduler::Event::DMA, &MMU::finish_dma, this);
+    }
+
+    void MMU::write_controller(u16 address, u8 value)
+    {
+        if (!cartridge) {
+            return;
+        }
+
+        switch (cartridge->header().controller) {
+            case Cartridge::Controller::None: break;
+            case Cartridge::Controller::MBC1:
+                switch (address >> 13) {
+                    case 0:
+                        banks.ram_enabled = (value & 0x0F) == 0x0A;
+                        map_ram();
+                        break;
+                    case 1:
+                        banks.rom = value & 0x1F ? value & 0x1F : 1;
+                        map_rom();
+                        break;
+                    // Bits 5-6 of the ROM bank, and the RAM bank in mode 1
+                    case 2:
+                        banks.upper = value & 0x03;
+                        map_rom();
+                        map_ram();
+                        break;
+                    case 3:
+                        banks.mode = value & 0x01;
+                        map_rom();
+                        map_ram();
+                        break;
+                }
+                break;
+            case Cartridge::Controller::MBC2:
+                // Address bit 8 selects between the RAM enable and the ROM bank
+                if (address >= 0x4000) {
+                    break;
+                }
+                if (address & 0x100) {
+                    banks.rom = value & 0x0F ? value & 0x0F : 1;
+                    map_rom();
+                } else {
+                    banks.ram_enabled = (value & 0x0F) == 0x0A;
+                }
+                break;
+            case Cartridge::Controller::MBC3:
+                switch (address >> 13) {
+                    case 0:
+                        banks.ram_enabled = (value & 0x0F) == 0x0A;
+                        map_ram();
+                        break;
+                    case 1:
+                        banks.rom = value & 0x7F ? value & 0x7F : 1;
+                        map_rom();
+                        break;
+                    // RAM bank 0x00-0x07 or clock register 0x08-0x0C
+                    case 2:
+                        banks.ram = value;
+                        map_ram();
+                        break;
+                    // Writing 0x00 then 0x01 latches the clock
+                    case 3:
+                        if (banks.latch == 0x00 && value == 0x01) {
+                            cartridge->clock().latch();
+                        }
+                        banks.latch = value;
+                        break;
+                }
+                break;
+            case Cartridge::Controller::MBC5:
+                switch (address >> 12) {
+                    case 0:
+                    case 1:
+                        banks.ram_enabled = (value & 0x0F) == 0x0A;
+                        map_ram();
+                        break;
+                    // Bank 0 can be mapped at 0x4000 on MBC5
+                    case 2:
+                        banks.rom = (banks.rom & 0x100) | value;
+                        map_rom();
+                        break;
+                    case 3:
+                        banks.rom = (banks.rom & 0xFF) | (value & 0x01) << 8;
+                        map_rom();
+                        break;
+                    case 4:
+                    case 5:
+                        banks.ram = value & 0x0F;
+                        map_ram();
+                        break;
+                }
+                break;
+        }
+    }
+
+    void MMU::map_rom(bool force)
+    {
+        u16 count = cartridge->header().rom_banks;
+        u16 low = 0;
+        u16 high = banks.rom;
+        if (cartridge->header().controller == Cartridge::Controller::MBC1) {
+            high |= banks.upper << 5;
+            low = banks.mode ? banks.upper << 5 : 0;
+        }
+        low %= count;
+        high %= count;
+
+        // Only MBC1 in mode 1 moves bank 0, code decoded from it is keyed as bank 0
+        if (low != banks.low || force) {
+            banks.low = low;
+            map_rom_bank(0x00, cartridge->rom_bank(low));
+            invalidate_code(0x00, 0x3F);
+        }
+        if (high != banks.high || force) {
+            banks.high = high;
+            map_rom_bank(0x40, cartridge->rom_bank(high));
+            if (decode_cache) {
+                decode_cache->switch_bank();
+            }
+        }
+    }
+
+    void MMU::map_rom_bank(u8 first, const u8 *bank)
+    {
+        // ROM pages keep their region and null write pointer, only the read pointers move
+        u8 *host = const_cast<u8 *>(bank);
+        for (unsigned int page = first; page < first + 0x40u; page++) {
+            host_pages[page] = host + (page - first) * 0x100;
+            read_pages[page] = watched_pages[page] & watch_read ? nullptr : host_pages[page];
+        }
+    }
+
+    void MMU::map_ram()
+    {
+        // Enabled RAM banks are plain memory, the clock, MBC2 RAM and disabled RAM are not
+        u8 *ram = nullptr;
+        const Cartridge::Header &header = cartridge->header();
+        if (banks.ram_enabled && header.ram_banks) {
+            switch (header.controller) {
+                case Cartridge::Controller::MBC1:
+                    ram = cartridge->ram_bank(banks.mode ? banks.upper : 0);
+                    break;
+                case Cartridge::Controller::MBC3:
+                    ram = banks.ram < 0x08 ? cartridge->ram_bank(banks.ram) : nullptr;
+                    break;
+                case Cartridge::Controller::MBC5: ram = cartridge->ram_bank(banks.ram); break;
+                case Cartridge::Controller::None:
+                case Cartridge::Controller::MBC2: break;
+            }
+        }
+        // A cartridge without a controller has its RAM always enabled
+        if (header.controller == Cartridge::Controller::None && header.ram_banks) {
+            ram = cartridge->ram_bank(0);
+        }
+
+        map(0xA0, 0xBF, ram ? Region::Memory : Region::CartridgeRam, ram);
+        invalidate_code(0xA0, 0xBF);
+    }
+
+    u8 MMU::read_cartridge_ram(u16 address) const
+    {
+        if (!cartridge || !banks.ram_enabled) {
+            return 0xFF;
+        }
+        switch (cartridge->header().controller) {
+            case Cartridge::Controller::MBC2:
+                return 0xF0 | cartridge->ram_data()[address & 0x1FF];
+            case Cartridge::Controller::MBC3:
+                if (banks.ram >= 0x08 && banks.ram <= 0x0C) {
+                    return cartridge->clock().read(banks.ram);
+                }
+                break;
+            default: break;
+        }
+        return 0xFF;
+    }
+
+    void MMU::write_cartridge_ram(u16 address, u8 value)
+    {
+        if (!cartridge || !banks.ram_enabled) {
+            return;
+        }
+        switch (cartridge->header().controller) {
+            case Cartridge::Controller::MBC2:
+                cartridge->ram_data()[address & 0x1FF] = value & 0x0F;
+                break;
+            case Cartridge::Controller::MBC3:
+                if (banks.ram >= 0x08 && banks.ram <= 0x0C) {
+                    cartridge->clock().write(banks.ram, value);
+                }
+                break;
+            default: break;
+        }
+    }
+
+    u8 MMU::read_slow(u16 address) const
+    {
+        if (dma.active && address < 0xFF00) {
+            return 0xFF;
+        }
+        u8 value = read_region(address);
+        if (watched_pages[address >> 8] & watch_read && watched_reads[address]) {
+            report(Trap::Kind::Read, address, value);
+        }
+        return value;
+    }
+
+    u8 MMU::read_region(u16 address) const
+    {
+        u8 offset = address & 0xFF;
+        switch (regions[address >> 8]) {
+            case Region::CartridgeRam: return read_cartridge_ram(address);
+            case Region::Oam: return offset < oam.size() ? oam[offset] : 0xFF;
+            case Region::Io: return io[offset];
+            case Region::Memory:
+            case Region::Rom:
+            case Region::Vram: break;
+        }
+        const u8 *host = host_pages[address >> 8];
+        return host ? host[offset] : 0xFF;
+    }
+
+    void MMU::write_slow(u16 address, u8 value)
+    {
+        if (dma.active && address < 0xFF00) {
+            return;
+        }
+
+        u8 page = address >> 8;
+        u8 offset = address & 0xFF;
+        if (watched_pages[page] & watch_write && watched_writes[address]) {
+            report(Trap::Kind::Write, address, value);
+        }
+        // ROM writes reach the bank controller and never change code, store_page_io checks
+        // the IO page itself so register writes keep HRAM code
+        if (code_pages[code_page(page)] && regions[page] != Region::Rom &&
+            regions[page] != Region::Io) {
+            invalidate_code(code_page(page));
+        }
+
+        switch (regions[page]) {
+            case Region::Memory: host_pages[page][offset] = value; break;
+            case Region::Vram:
+                host_pages[page][offset] = value;
+                if (ppu && address < 0x9800) {
+                    ppu->invalidate_tile((address - 0x8000) >> 4);
+                } else if (ppu) {
+                    ppu->invalidate_map_entry(address - 0x9800);
+                }
+                break;
+            case Region::Rom: write_controller(address, value); break;
+            case Region::CartridgeRam: write_cartridge_ram(address, value); break;
+            case Region::Oam:
+                if (offset < oam.size()) {
+                    oam[offset] = value;
+                    // Tile and attributes are read as the sprite is drawn
+                    if (ppu && offset % 4 < 2) {
+                        ppu->invalidate_sprites(offset / 4, offset / 4);
+                    }
+                }
+                break;
+            case Region::Io: store_page_io(offset, value); break;
+        }
+    }
+
+    void MMU::write_interrupt_flags(u8 offset, u8 value)
+    {
+        store_io(offset, value);
+        update_interrupts();
+    }
+
+    void MMU::write_divider(u8, u8) { io[0x04] = 0; }
+
+    void MMU::write_sound(u8 offset, u8 value)
+    {
+        // Powered off, the APU ignores everything but NR52 and wave RAM
+        if (!(io[0x26] & 0x80)) {
+            return;
+        }
+        store_io(offset, value);
+        if (offset >= 0x24) {
+            return;
+        }
+
+        // A channel whose DAC is off stops, otherwise setting the trigger bit starts it
+        u8 channel = (offset - 0x10) / 5;
+        u8 status = 1 << channel;
+        bool dac = channel == 2 ? io[0x1A] & 0x80 : io[0x12 + channel * 5] & 0xF8;
+        if (!dac) {
+            io[0x26] &= ~status;
+        } else if ((offset - 0x10) % 5 == 4 && value & 0x80) {
+            io[0x26] |= status;
+        }
+    }
+
+    void MMU::write_sound_control(u8 offset, u8 value)
+    {
+        store_io(offset, value);
+        if (!(value & 0x80)) {
+            for (u8 reg = 0x10; reg <= 0x26; reg++) {
+                io[reg] = io_ports[reg].unused;
+            }
+        }
+    }
+
+    void MMU::write_lcd_control(u8 offset, u8 value)
+    {
+        // Switching the LCD off resets LY and leaves the PPU in mode 0
+        bool was_on = io[0x40] & 0x80;
+        if (ppu) {
+            ppu->catch_up();
+        }
+        store_io(offset, value);
+        if (!(value & 0x80)) {
+            io[0x44] = 0;
+            io[0x41] &= ~0x03;
+        }
+        if (ppu && was_on != (bool)(value & 0x80)) {
+            ppu->switch_lcd(value & 0x80);
+        }
+    }
+
+    void MMU::write_lcd_register(u8 offset, u8 value)
+    {
+        if (ppu) {
+            ppu->catch_up();
+        }
+        store_io(offset, value);
+    }
+
+    void MMU::write_dma(u8 offset, u8 value)
+    {
+        store_io(offset, value);
+        // A restart keeps what the running transfer has copied so far
+        if (dma.active) {
+            copy_dma(dma_progress());
+        }
+        // Pages above work RAM read its echo
+        dma.source = value >= 0xE0 ? value - 0x20 : value;
+        dma.copied = 0;
+        if (!scheduler) {
+            copy_dma(oam.size());
+            return;
+        }
+
+        dma.start = scheduler->now();
+        if (!dma.active) {
+            dma.active = true;
+            read_pages.fill(nullptr);
+            write_pages.fill(nullptr);
+            if (decode_cache) {
+                decode_cache->lock_bus();
+            }
+        }
+        scheduler->schedule(Scheduler::Event::DMA, dma.start + dma_cycles);
+    }
+
+    u8 MMU::dma_progress() const
+    {
+        // One byte every 4 cycles
+        return (u8)std::min<u64>((scheduler->now() - dma.start) / 4, oam.size());
+    }
+
+    void MMU::copy_dma(u8 end)
+    {
+        if (dma.copied >= end) {
+            return;
+        }
+        const u8 *source = host_pages[dma.source];
+        if (source) {
+            std::memcpy(oam.data() + dma.copied, source + dma.copied, end - dma.copied);
+        } else {
+            for (u8 i = dma.copied; i < end; i++) {
+                oam[i] = read_region(dma.source << 8 | i);
+            }
+        }
+        if (ppu) {
+            ppu->invalidate_sprites(dma.copied / 4, (end - 1) / 4);
+        }
+        dma.copied = end;
+    }
+
+    void MMU::end_dma()
+    {
+        copy_dma(oam.size());
+        dma.active = false;
+        for (unsigned int page = 0; page < 256; page++) {
+            update_page(page);
+        }
+    }
+
+    void MMU::finish_dma(void *memory, u64) { static_cast<MMU *>(memory)->end_dma(); }
+
+    const u8 *MMU::object_attributes()
+    {
+        if (dma.active) {
+            copy_dma(dma_progress());
+        }
+        return oam.data();
+    }
+
+    void MMU::set_watchpoint(u16 address, Trap::Kind kind)
+    {
+        u8 page = address >> 8;
+        if (kind == Trap::Kind::Read) {
+            watched_reads.set(address);
+            watched_pages[page] |= watch_read;
+        } else if (kind == Trap::Kind::Write) {
+            watched_writes.set(address);
+            watched_pages[page] |= watch_write;
+        }
+        update_page(page);
+    }
+
+    void MMU::clear_watchpoint(u16 address, Trap::Kind kind)
+    {
+        u8 page = address >> 8;
+        if (kind == Trap::Kind::Read) {
+            watched_reads.reset(address);
+        } else if (kind == Trap::Kind::Write) {
+            watched_writes.reset(address);
+        }
+
+        // The page goes back to host pointers once nothing on it is watched
+        watched_pages[page] = 0;
+        for (u32 watched = page << 8; watched < (page + 1u) << 8; watched++) {
+            watched_pages[page] |= (watched_reads[watched] ? watch_read : 0) |
+                                   (watched_writes[watched] ? watch_write : 0);
+        }
+        update_page(page);
+    }
+
+    void MMU::set_trap_handler(TrapHandler handler, void *context)
+    {
+        trap_handler = handler;
+        trap_context = context;
+    }
+
+    void MMU::report(Trap::Kind kind, u16 address, u8 value) const
+    {
+        if (trap_handler) {
+            trap_handler(trap_context, {kind, address, value});
+        }
+    }
+
+    void MMU::mark_code_page(u8 page)
+    {
+        page = code_page(page);
+        code_pages[page] = true;
+        write_pages[page] = nullptr;
+        if (page >= 0xC0 && page < 0xDE) {
+            write_pages[page + 0x20] = nullptr;
+        }
+    }
+
+    const u8 *MMU::read_span([[maybe_unused]] u16 address, [[maybe_unused]] u16 length) const
+    {
+#if defined(GAMEBOY_HEATMAP)
+        // Bulk transfers would go uncounted
+        return nullptr;
+#else
+        return span(address, length, read_pages);
+#endif
+    }
+
+    u8 *MMU::write_span([[maybe_unused]] u16 address, [[maybe_unused]] u16 length)
+    {
+#if defined(GAMEBOY_HEATMAP)
+        return nullptr;
+#else
+        u8 *host = span(address, length, write_pages);
+        u32 end = address + length;
+        if (host || !ppu || length == 0 || address < 0x8000 || end > 0xA000 || dma.active) {
+            return host;
+        }
+
+        // VRAM has no write pointers, a bulk write invalidates its tiles and map entries up
+        // front instead
+        for (u32 page = address >> 8; page <= (end - 1) >> 8; page++) {
+            if (code_pages[page] || watched_pages[page] & watch_write) {
+                return nullptr;
+            }
+        }
+        for (u32 tile = (address - 0x8000) >> 4; tile < (std::min(end, 0x9800u) - 0x7FF1) >> 4;
+             tile++) {
+            ppu->invalidate_tile(tile);
+        }
+        for (u32 entry = std::max<u32>(address, 0x9800); entry < end; entry++) {
+            ppu->invalidate_map_entry(entry - 0x9800);
+        }
+        return vram.data() + address - 0x8000;
+#endif
+    }
+
+    u8 *MMU::span(u16 address, u16 length, const PageTable &table) const
+    {
+        if (length == 0 || address + length > 0x10000) {
+            return nullptr;
+        }
+        u8 first = address >> 8;
+        u8 *host = table[first];
+        for (u32 page = first; page <= (address + length - 1u) >> 8; page++) {
+            if (!host || table[page] != host + (page - first) * 0x100) {
+                return nullptr;
+            }
+        }
+        return host + (address & 0xFF);
+    }
+
+    void MMU::invalidate_code(u8 first, u8 last)
+    {
+        for (unsigned int page = first; page <= last; page++) {
+            if (code_pages[page]) {
+                invalidate_code(page);
+            }
+        }
+    }
+
+    void MMU::invalidate_code(u8 page)
+    {
+        code_pages[page] = false;
+        update_page(page);
+        if (page >= 0xC0 && page < 0xDE) {
+            update_page(page + 0x20);
+        }
+        if (decode_cache) {
+            decode_cache->invalidate_page(page);
+            if (page >= 0xC0 && page < 0xDE) {
+                decode_cache->invalidate_page(page + 0x20);
+            }
+        }
+    }
 } // namespace Gameboy
\ No newline at end of file
@@ -1,21 +1,283 @@
 #pragma once
 
+#include "heatmap.h"
+#include "trap.h"
 #include "types.h"
 
+#include <array>
+#include <bitset>
+#include <cstddef>
+
 namespace Gameboy
 {
+    class Cartridge;
+    class CodeCache;
+    class PPU;
+    class Scheduler;
+
+    // The address space as 256 pages of 256 bytes. A page of plain memory holds host pointers
+    // so reads and writes are a single indexed access; everything else goes through the
+    // handler for the page's region. Pages holding decoded code drop their write pointer, so
+    // the code check is only made on the slow path. Watchpoints work the same way.
     class MMU
     {
       public:
         MMU();
+        MMU(const MMU &) = delete;
+        MMU &operator=(const MMU &) = delete;
+
+        // Maps the cartridge's banks straight out of its file mapping. A bank switch only
+        // repoints the pages of the switched region.
+        void load_cartridge(Cartridge *cartridge);
+        Cartridge *loaded_cartridge() const { return cartridge; }
+        // Copies up to 32 KiB of ROM into 0x0000-0x7FFF, for running code without a cartridge
+        void load_rom(const u8 *data, std::size_t size);
+
+        // Times OAM DMA. Without a scheduler a transfer completes as soon as it starts.
+        void set_scheduler(Scheduler *scheduler);
+
+        u8 read(u16 address) const
+        {
+#if defined(GAMEBOY_HEATMAP)
+            count(Heatmap::Access::Read, address);
+#endif
+            const u8 *page = read_pages[address >> 8];
+            return page ? page[address & 0xFF] : read_slow(address);
+        }
+        // IO registers are plain storage to read, unused bits always hold 1 and whatever drives
+        // a register keeps it current
+        u8 read_io(u8 offset) const
+        {
+#if defined(GAMEBOY_HEATMAP)
+            count(Heatmap::Access::Read, 0xFF00 + offset);
+#endif
+            u8 value = io[offset];
+            if (watched_pages[0xFF] & watch_read && watched_reads[0xFF00 + offset]) {
+                report(Trap::Kind::Read, 0xFF00 + offset, value);
+            }
+            return value;
+        }
+
+        void write(u16 address, u8 value)
+        {
+#if defined(GAMEBOY_HEATMAP)
+            count(Heatmap::Access::Write, address);
+#endif
+            u8 *page = write_pages[address >> 8];
+            if (page) {
+                page[address & 0xFF] = value;
+            } else {
+                write_slow(address, value);
+            }
+        }
+        void write_io(u8 offset, u8 value)
+        {
+#if defined(GAMEBOY_HEATMAP)
+            count(Heatmap::Access::Write, 0xFF00 + offset);
+#endif
+            if (watched_pages[0xFF] & watch_write && watched_writes[0xFF00 + offset]) {
+                report(Trap::Kind::Write, 0xFF00 + offset, value);
+            }
+            store_page_io(offset, value);
+        }
+
+        // IE & IF, kept current on writes to either so the CPU never reads them per step
+        u8 pending_interrupts() const { return interrupts; }
+        // Where that mask lives, for compiled code to test it without a call
+        const u8 *pending_interrupts_mask() const { return &interrupts; }
+        void request_interrupt(u8 interrupt)
+        {
+            io[0x0F] |= 1 << interrupt;
+            update_interrupts();
+        }
+
+        // The bank mapped at 0x4000-0x7FFF
+        u16 rom_bank() const { return banks.high; }
 
-        u8 read(u16 address) const { return memory[address]; }
-        u8 read_io(u8 offset) const { return memory[0xFF00 + offset]; }
+        void set_decode_cache(CodeCache *cache) { decode_cache = cache; }
+        void mark_code_page(u8 page);
+        // Whether OAM DMA has the bus, leaving the CPU only page 0xFF
+        bool dma_active() const { return dma.active; }
 
-        void write(u16 address, u8 value) { memory[address] = value; }
-        void write_io(u8 offset, u8 value) { memory[0xFF00 + offset] = value; }
+        // Host memory behind a range of plain, contiguous pages, or null
+        const u8 *read_span(u16 address, u16 length) const;
+        u8 *write_span(u16 address, u16 length);
+
+        // The PPU is told about writes to tile data and sprite positions and the LCD being
+        // switched on or off, and caught up before a write to a register it draws with
+        void set_ppu(PPU *new_ppu) { ppu = new_ppu; }
+        const u8 *video_ram() const { return vram.data(); }
+        // OAM as the PPU sees it, with a running DMA transfer brought up to date first
+        const u8 *object_attributes();
+        // IO registers as stored, for other components to read without side effects
+        u8 peek_io(u8 offset) const { return io[offset]; }
+        // LY, and STAT's mode and coincidence bits
+        void set_lcd_status(u8 line, u8 mode, bool coincidence)
+        {
+            io[0x44] = line;
+            io[0x41] = (io[0x41] & ~0x07) | mode | coincidence << 2;
+        }
+
+        // Watchpoints on Read or Write accesses to a bus address. A watched page drops its
+        // host pointer for that kind of access, so unwatched pages run at full speed. Page 0xFF
+        // has none and read_io/write_io test it on every access. The CPU decoding code from a
+        // watched address reports a read too.
+        void set_watchpoint(u16 address, Trap::Kind kind);
+        void clear_watchpoint(u16 address, Trap::Kind kind);
+        void set_trap_handler(TrapHandler handler, void *context);
+
+#if defined(GAMEBOY_HEATMAP)
+        // Reads and writes are counted here, executes by the CPU
+        void count_execute(u16 address) const { count(Heatmap::Access::Execute, address); }
+        const Heatmap &heatmap() const { return access_counts; }
+#endif
 
       private:
-        u8 *memory;
+        enum class Region : u8 { Memory, Rom, CartridgeRam, Vram, Oam, Io };
+        typedef std::array<u8 *, 256> PageTable;
+
+        // OAM DMA copies a page to OAM over 640 cycles, while the CPU only reaches HRAM and IO.
+        // The page tables are emptied for the duration so the fast path never checks for it.
+        // Nothing else can write the source meanwhile, so bytes are copied in bulk when the
+        // transfer ends, or when OAM is looked at before that.
+        struct Dma {
+            bool active = false;
+            u8 source = 0;
+            u8 copied = 0;
+            u64 start = 0;
+        };
+        static constexpr unsigned int dma_cycles = 640;
+
+        // How a write to 0xFF00-0xFF7F behaves. Most registers only store their writable bits,
+        // registers with side effects name a handler that does the store itself.
+        typedef void (MMU::*IoWrite)(u8 offset, u8 value);
+        struct IoPort {
+            u8 unused = 0xFF;  // read back as 1
+            u8 writable = 0x00;
+            IoWrite write = nullptr;
+        };
+
+        // Memory bank controller registers, and the ROM banks they currently map
+        struct Banks {
+            u16 rom = 1;
+            u8 upper = 0;  // MBC1 ROM bank bits 5-6, or its RAM bank in mode 1
+            u8 ram = 0;    // RAM bank, or an MBC3 clock register
+            bool ram_enabled = false;
+            bool mode = false;
+            u8 latch = 0xFF;
+            u16 low = 0;
+            u16 high = 1;
+        };
+
+        u8 read_slow(u16 address) const;
+        u8 read_region(u16 address) const;
+        void write_slow(u16 address, u8 value);
+        u8 *span(u16 address, u16 length, const PageTable &table) const;
+        void map(u8 first, u8 last, Region region, const u8 *memory);
+        void update_page(u8 page);
+        void report(Trap::Kind kind, u16 address, u8 value) const;
+        void invalidate_code(u8 first, u8 last);
+
+        void write_controller(u16 address, u8 value);
+        void map_rom(bool force = false);
+        void map_rom_bank(u8 first, const u8 *bank);
+        void map_ram();
+        u8 read_cartridge_ram(u16 address) const;
+        void write_cartridge_ram(u16 address, u8 value);
+
+        void invalidate_code(u8 page);
+
+        // A write to page 0xFF once it has been counted and checked against watchpoints
+        void store_page_io(u8 offset, u8 value)
+        {
+            if (offset < io_ports.size()) {
+                IoWrite handler = io_ports[offset].write;
+                if (handler) {
+                    (this->*handler)(offset, value);
+                } else {
+                    store_io(offset, value);
+                }
+            } else {
+                // High RAM and IE. Only these can hold code, IO registers never do.
+                io[offset] = value;
+                if (offset == 0xFF) {
+                    update_interrupts();
+                }
+                if (code_pages[0xFF]) {
+                    invalidate_code(0xFF);
+                }
+            }
+        }
+        void store_io(u8 offset, u8 value)
+        {
+            u8 writable = io_ports[offset].writable;
+            io[offset] = (io[offset] & ~writable) | (value & writable);
+        }
+        void write_interrupt_flags(u8 offset, u8 value);
+        void write_divider(u8 offset, u8 value);
+        void write_sound(u8 offset, u8 value);
+        void write_sound_control(u8 offset, u8 value);
+        void write_lcd_control(u8 offset, u8 value);
+        void write_lcd_register(u8 offset, u8 value);
+        void write_dma(u8 offset, u8 value);
+
+        u8 dma_progress() const;
+        void copy_dma(u8 end);
+        void end_dma();
+        static void finish_dma(void *memory, u64 timestamp);
+
+        void update_interrupts() { interrupts = io[0xFF] & io[0x0F] & 0x1F; }
+
+#if defined(GAMEBOY_HEATMAP)
+        void count(Heatmap::Access access, u16 address) const
+        {
+            // ROM by its offset in the file under the banks mapped now
+            u32 location = address >= 0x8000 ? access_counts.rom_size() + address - 0x8000
+                           : address >= 0x4000 ? banks.high * 0x4000u + address - 0x4000
+                                               : banks.low * 0x4000u + address;
+            access_counts.count(access, location);
+        }
+#endif
+
+        // Echo RAM pages are tracked as the work RAM they mirror
+        static u8 code_page(u8 page) { return page >= 0xE0 && page < 0xFE ? page - 0x20 : page; }
+
+      private:
+        static const std::array<IoPort, 0x80> io_ports;
+
+        // Host memory per page, null when the access needs the region's handler
+        PageTable read_pages;
+        PageTable write_pages;
+        // The memory behind Memory and Rom pages, whether or not accesses may use it directly
+        PageTable host_pages;
+        std::array<Region, 256> regions;
+        std::array<u8, 0x8000> rom = {};
+        std::array<u8, 0x2000> vram = {};
+        std::array<u8, 0x2000> external_ram = {};
+        std::array<u8, 0x2000> wram = {};
+        std::array<u8, 0xA0> oam = {};
+        std::array<u8, 0x100> io = {};
+
+        std::array<bool, 256> code_pages = {};
+        u8 interrupts = 0;
+        Cartridge *cartridge = nullptr;
+        Banks banks;
+        CodeCache *decode_cache = nullptr;
+        PPU *ppu = nullptr;
+
+        Dma dma;
+        Scheduler *scheduler = nullptr;
+
+        static constexpr u8 watch_read = 1;
+        static constexpr u8 watch_write = 2;
+        std::bitset<0x10000> watched_reads;
+        std::bitset<0x10000> watched_writes;
+        std::array<u8, 256> watched_pages = {};
+        TrapHandler trap_handler = nullptr;
+        void *trap_context = nullptr;
+
+#if defined(GAMEBOY_HEATMAP)
+        mutable Heatmap access_counts;
+#endif
     };
 } // namespace Gameboy
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "pixel_fifo.h"
+
+#include "mmu.h"
+
+namespace Gameboy
+{
+    void PixelFifo::start(u8 new_line, u8 new_window_line, u64 timestamp, u8 *new_out,
+                          const u8 *line_sprites, u8 count)
+    {
+        line = new_line;
+        window_line = new_window_line;
+        clock = timestamp;
+        out = new_out;
+        x = 0;
+        discard = memory->peek_io(0x43) % 8;
+        stall = startup_dots;
+        window = false;
+        fetch_step = 0;
+        fetch_column = 0;
+        background_count = 0;
+        sprite_count = 0;
+        next_sprite = 0;
+        pending_sprite = no_sprite;
+
+        // X 0 is hidden and never fetched
+        const u8 *oam = memory->object_attributes();
+        sprite_height = memory->peek_io(0x40) & 0x04 ? 16 : 8;
+        sprite_total = 0;
+        for (u8 i = 0; i < count; i++) {
+            const u8 *sprite = oam + line_sprites[i] * 4;
+            if (sprite[1]) {
+                sprites[sprite_total++] = {sprite[0], sprite[1], sprite[2], sprite[3]};
+            }
+        }
+    }
+
+    void PixelFifo::run(u64 until)
+    {
+        while (clock < until && x < width) {
+            dot();
+            clock++;
+        }
+    }
+
+    void PixelFifo::dot()
+    {
+        if (stall) {
+            stall--;
+            return;
+        }
+        u8 lcdc = memory->peek_io(0x40);
+
+        // A sprite waits for the fetcher to finish its tile, then takes the fetcher over
+        if (pending_sprite != no_sprite) {
+            if (fetch_step < 6) {
+                fetch(lcdc);
+                return;
+            }
+            mix_sprite(sprites[pending_sprite]);
+            pending_sprite = no_sprite;
+            stall = sprite_dots - 1;
+            return;
+        }
+
+        // The window restarts the fetcher from its own first column. Left of the screen edge
+        // its first pixels are thrown away like the fine scroll.
+        u8 wx = memory->peek_io(0x4B);
+        if (!window && (lcdc & 0x21) == 0x21 && line >= memory->peek_io(0x4A) && x + 7u >= wx) {
+            window = true;
+            background_count = 0;
+            fetch_step = 0;
+            fetch_column = 0;
+            discard = wx < 7 ? 7 - wx : 0;
+        }
+
+        fetch(lcdc);
+        if (!background_count) {
+            return;
+        }
+        if (discard) {
+            background_count--;
+            discard--;
+            return;
+        }
+
+        if (lcdc & 0x02 && next_sprite < sprite_total && sprites[next_sprite].x <= x + 8u) {
+            pending_sprite = next_sprite++;
+            return;
+        }
+
+        u8 color = background[8 - background_count--];
+        if (!(lcdc & 0x01)) {
+            color = 0;
+        }
+        u8 sprite_color = 0;
+        u8 flags = 0;
+        if (sprite_count) {
+            sprite_color = sprite_colors[0];
+            flags = sprite_flags[0];
+            sprite_count--;
+            for (unsigned int i = 0; i < sprite_count; i++) {
+                sprite_colors[i] = sprite_colors[i + 1];
+                sprite_flags[i] = sprite_flags[i + 1];
+            }
+        }
+
+        if (sprite_color && lcdc & 0x02 && (!(flags & 0x80) || !color)) {
+            out[x] = memory->peek_io(flags & 0x10 ? 0x49 : 0x48) >> sprite_color * 2 & 3;
+        } else {
+            out[x] = memory->peek_io(0x47) >> color * 2 & 3;
+        }
+        x++;
+    }
+
+    void PixelFifo::fetch(u8 lcdc)
+    {
+        const u8 *vram = memory->video_ram();
+        switch (fetch_step) {
+            case 1: {
+                u16 map;
+                u8 column;
+                u8 y;
+                if (window) {
+                    map = lcdc & 0x40 ? 0x1C00 : 0x1800;
+                    column = fetch_column;
+                    y = window_line;
+                } else {
+                    map = lcdc & 0x08 ? 0x1C00 : 0x1800;
+                    column = memory->peek_io(0x43) / 8 + fetch_column;
+                    y = line + memory->peek_io(0x42);
+                }
+                u8 index = vram[map + y / 8 * 32 + column % 32];
+                u16 tile = lcdc & 0x10 ? index : 256 + (i8)index;
+                tile_row = tile * 16 + y % 8 * 2;
+                break;
+            }
+            case 3: tile_low = vram[tile_row]; break;
+            case 5: tile_high = vram[tile_row + 1]; break;
+            case 6:
+                if (background_count) {
+                    return;
+                }
+                for (unsigned int i = 0; i < 8; i++) {
+                    unsigned int bit = 7 - i;
+                    background[i] = (tile_low >> bit & 1) | (tile_high >> bit & 1) << 1;
+                }
+                background_count = 8;
+                fetch_column++;
+                fetch_step = 0;
+                return;
+        }
+        fetch_step++;
+    }
+
+    void PixelFifo::mix_sprite(const Sprite &sprite)
+    {
+        unsigned int row = line + 16 - sprite.y;
+        if (sprite.flags & 0x40) {
+            row = sprite_height - 1 - row;
+        }
+        u16 tile = sprite_height == 16 ? (sprite.tile & 0xFE) + row / 8 : sprite.tile;
+        const u8 *data = memory->video_ram() + tile * 16 + row % 8 * 2;
+
+        // Columns left of the screen edge are dropped
+        unsigned int first = sprite.x < 8 ? 8 - sprite.x : 0;
+        for (unsigned int column = first; column < 8; column++) {
+            unsigned int bit = sprite.flags & 0x20 ? column : 7 - column;
+            u8 color = (data[0] >> bit & 1) | (data[1] >> bit & 1) << 1;
+            unsigned int slot = column - first;
+            for (; sprite_count <= slot; sprite_count++) {
+                sprite_colors[sprite_count] = 0;
+            }
+            if (!sprite_colors[slot]) {
+                sprite_colors[slot] = color;
+                sprite_flags[slot] = sprite.flags;
+            }
+        }
+    }
+} // namespace Gameboy
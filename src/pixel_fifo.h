@@ -0,0 +1,85 @@
+#pragma once
+
+#include "types.h"
+
+#include <array>
+
+namespace Gameboy
+{
+    class MMU;
+
+    // Mode 3 a dot at a time, the way the hardware does it. A fetcher reads a tile row every 6
+    // dots into an 8 pixel background FIFO and a pixel leaves the FIFO each dot. Sprites stall
+    // both while their rows are read and mixed into a FIFO of their own. Registers are read on
+    // the dot that uses them, so a write partway through a line shows up where it lands.
+    class PixelFifo
+    {
+      public:
+        static constexpr unsigned int width = 160;
+
+        explicit PixelFifo(MMU *memory) : memory(memory) {}
+
+        // Starts mode 3 at the given time with the line's sprites, as OAM indices in the order
+        // they are fetched. Shades are written to out as the pixels come out.
+        void start(u8 line, u8 window_line, u64 timestamp, u8 *out, const u8 *line_sprites,
+                   u8 count);
+        // Runs the dots before the given time, stopping early after the last pixel
+        void run(u64 until);
+
+        bool done() const { return x == width; }
+        // The dot after the last one run
+        u64 time() const { return clock; }
+        // Pixels still to come out, each takes at least a dot
+        unsigned int remaining() const { return width - x; }
+        bool drew_window() const { return window; }
+
+      private:
+        struct Sprite {
+            u8 y;
+            u8 x;
+            u8 tile;
+            u8 flags;
+        };
+        static constexpr u8 no_sprite = 0xFF;
+        // The first fetch of a line is thrown away
+        static constexpr u8 startup_dots = 6;
+        static constexpr u8 sprite_dots = 6;
+
+        void dot();
+        void fetch(u8 lcdc);
+        void mix_sprite(const Sprite &sprite);
+
+      private:
+        MMU *memory;
+        u64 clock = 0;
+        u8 *out = nullptr;
+        u8 line = 0;
+        u8 window_line = 0;
+        u8 x = width;
+        u8 discard = 0;
+        u8 stall = 0;
+        bool window = false;
+
+        // Dots 0-5 read the tile number, low byte and high byte two dots each, dot 6 pushes
+        // once the background FIFO is empty
+        u8 fetch_step = 0;
+        u8 fetch_column = 0;
+        u16 tile_row = 0;
+        u8 tile_low = 0;
+        u8 tile_high = 0;
+
+        // Popped from the back, the fetcher only refills an empty FIFO
+        std::array<u8, 8> background = {};
+        u8 background_count = 0;
+        // Popped from the front, a sprite only fills the slots still transparent
+        std::array<u8, 8> sprite_colors = {};
+        std::array<u8, 8> sprite_flags = {};
+        u8 sprite_count = 0;
+
+        std::array<Sprite, 10> sprites = {};
+        u8 sprite_total = 0;
+        u8 sprite_height = 8;
+        u8 next_sprite = 0;
+        u8 pending_sprite = no_sprite;
+    };
+} // namespace Gameboy
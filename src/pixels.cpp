@@ -0,0 +1,288 @@
+#include "pixels.h"
+
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PIXELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, GCC and Clang want it declared
+#if defined(PIXELS_X86) && !defined(_MSC_VER)
+#define TARGET(features) __attribute__((target(features)))
+#else
+#define TARGET(features)
+#endif
+
+namespace Gameboy
+{
+    namespace Pixels
+    {
+        namespace
+        {
+            // Each bit of a byte to the low bit of its own byte in memory, bit 7 first
+            constexpr std::array<u64, 256> spread = [] {
+                std::array<u64, 256> table = {};
+                for (unsigned int value = 0; value < 256; value++) {
+                    for (unsigned int x = 0; x < 8; x++) {
+                        unsigned int shift =
+                            std::endian::native == std::endian::little ? x * 8 : (7 - x) * 8;
+                        table[value] |= (u64)(value >> (7 - x) & 1) << shift;
+                    }
+                }
+                return table;
+            }();
+
+            std::array<u8, 4> shades(u8 palette)
+            {
+                return {(u8)(palette & 3), (u8)(palette >> 2 & 3), (u8)(palette >> 4 & 3),
+                        (u8)(palette >> 6)};
+            }
+
+            std::array<u32, 4> palette_colors(u8 palette, const std::array<u32, 4> &colors)
+            {
+                return {colors[palette & 3], colors[palette >> 2 & 3], colors[palette >> 4 & 3],
+                        colors[palette >> 6]};
+            }
+
+            void decode_rows_scalar(const u8 *data, u8 *indices, std::size_t rows)
+            {
+                for (std::size_t row = 0; row < rows; row++) {
+                    u64 pixels = spread[data[row * 2]] | spread[data[row * 2 + 1]] << 1;
+                    std::memcpy(indices + row * 8, &pixels, 8);
+                }
+            }
+
+            void apply_palette_scalar(const u8 *indices, u8 *out, std::size_t count, u8 palette)
+            {
+                auto table = shades(palette);
+                for (std::size_t i = 0; i < count; i++) {
+                    out[i] = table[indices[i]];
+                }
+            }
+
+            void expand_palette_scalar(const u8 *indices, u32 *rgba, std::size_t count,
+                                       u8 palette, const std::array<u32, 4> &colors)
+            {
+                auto table = palette_colors(palette, colors);
+                for (std::size_t i = 0; i < count; i++) {
+                    rgba[i] = table[indices[i]];
+                }
+            }
+
+#if defined(PIXELS_X86)
+            // Decoding broadcasts a row's low and high bytes across 8 lanes each, tests one bit
+            // per lane and clamps what is left to 1. Palettes are a 4 entry pshufb table; for
+            // RGBA each index becomes the 4 byte offsets of its colour.
+
+            // pshufb controls taking byte first, first + 2, first + 4... each repeated
+            // `repeat` times
+            template <unsigned int count, int first, int step, int repeat> struct Spread {
+                alignas(32) u8 bytes[count];
+                constexpr Spread() : bytes()
+                {
+                    for (unsigned int i = 0; i < count; i++) {
+                        bytes[i] = (u8)(first + step * (int)(i / repeat));
+                    }
+                }
+            };
+            constexpr Spread<64, 0, 2, 8> row_bytes;
+            constexpr Spread<16, 0, 1, 4> quad_bytes;
+            // AVX2 lanes shuffle on their own, so the high lane of each control starts over
+            constexpr Spread<16, 4, 1, 4> upper_quad_bytes;
+
+            TARGET("ssse3") void apply_palette_ssse3(const u8 *indices, u8 *out, std::size_t count,
+                                                     u8 palette)
+            {
+                auto table = shades(palette);
+                const __m128i lookup =
+                    _mm_setr_epi8(table[0], table[1], table[2], table[3], 0, 0, 0, 0, 0, 0, 0, 0,
+                                  0, 0, 0, 0);
+                std::size_t i = 0;
+                for (; i + 16 <= count; i += 16) {
+                    __m128i values = _mm_loadu_si128((const __m128i *)(indices + i));
+                    _mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(lookup, values));
+                }
+                apply_palette_scalar(indices + i, out + i, count - i, palette);
+            }
+
+            TARGET("ssse3") void expand_palette_ssse3(const u8 *indices, u32 *rgba,
+                                                      std::size_t count, u8 palette,
+                                                      const std::array<u32, 4> &colors)
+            {
+                auto table = palette_colors(palette, colors);
+                const __m128i lookup = _mm_loadu_si128((const __m128i *)table.data());
+                const __m128i bytes = _mm_set1_epi32(0x03020100);
+                const __m128i quad = _mm_load_si128((const __m128i *)quad_bytes.bytes);
+
+                std::size_t i = 0;
+                for (; i + 16 <= count; i += 16) {
+                    __m128i values = _mm_loadu_si128((const __m128i *)(indices + i));
+                    for (int k = 0; k < 4; k++) {
+                        __m128i offsets = _mm_shuffle_epi8(values, quad);
+                        offsets = _mm_add_epi8(offsets, offsets);
+                        offsets = _mm_add_epi8(_mm_add_epi8(offsets, offsets), bytes);
+                        _mm_storeu_si128((__m128i *)(rgba + i + k * 4),
+                                         _mm_shuffle_epi8(lookup, offsets));
+                        values = _mm_srli_si128(values, 4);
+                    }
+                }
+                expand_palette_scalar(indices + i, rgba + i, count - i, palette, colors);
+            }
+
+            // The same again with both 128-bit lanes working, vpshufb stays within a lane
+
+            TARGET("avx2") void decode_rows_avx2(const u8 *data, u8 *indices, std::size_t rows)
+            {
+                const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+                const __m256i one = _mm256_set1_epi8(1);
+                std::size_t row = 0;
+                for (; row + 8 <= rows; row += 8) {
+                    __m256i tile = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i *)(data + row * 2)));
+                    for (int k = 0; k < 2; k++) {
+                        // Rows 4k and 4k+1 in the low lane, 4k+2 and 4k+3 in the high one
+                        __m256i controls = _mm256_load_si256((const __m256i *)row_bytes.bytes + k);
+                        __m256i low = _mm256_shuffle_epi8(tile, controls);
+                        __m256i high = _mm256_shuffle_epi8(tile, _mm256_add_epi8(controls, one));
+                        low = _mm256_min_epu8(_mm256_and_si256(low, bits), one);
+                        high = _mm256_min_epu8(_mm256_and_si256(high, bits), one);
+                        __m256i out = _mm256_or_si256(low, _mm256_add_epi8(high, high));
+                        _mm256_storeu_si256((__m256i *)(indices + row * 8 + k * 32), out);
+                    }
+                }
+                // GCC leaves out the vzeroupper in front of a tail call
+                _mm256_zeroupper();
+                decode_rows_scalar(data + row * 2, indices + row * 8, rows - row);
+            }
+
+            TARGET("avx2") void apply_palette_avx2(const u8 *indices, u8 *out, std::size_t count,
+                                                   u8 palette)
+            {
+                auto table = shades(palette);
+                u32 packed = table[0] | table[1] << 8 | table[2] << 16 | (u32)table[3] << 24;
+                const __m256i lookup =
+                    _mm256_setr_epi32((int)packed, 0, 0, 0, (int)packed, 0, 0, 0);
+                std::size_t i = 0;
+                for (; i + 32 <= count; i += 32) {
+                    __m256i values = _mm256_loadu_si256((const __m256i *)(indices + i));
+                    _mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(lookup, values));
+                }
+                _mm256_zeroupper();
+                apply_palette_ssse3(indices + i, out + i, count - i, palette);
+            }
+
+            TARGET("avx2") void expand_palette_avx2(const u8 *indices, u32 *rgba,
+                                                    std::size_t count, u8 palette,
+                                                    const std::array<u32, 4> &colors)
+            {
+                auto table = palette_colors(palette, colors);
+                const __m256i lookup =
+                    _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table.data()));
+                const __m256i bytes = _mm256_set1_epi32(0x03020100);
+                // 8 indices in both lanes, the low lane takes the first four
+                const __m256i octet =
+                    _mm256_setr_m128i(_mm_load_si128((const __m128i *)quad_bytes.bytes),
+                                      _mm_load_si128((const __m128i *)upper_quad_bytes.bytes));
+
+                std::size_t i = 0;
+                for (; i + 8 <= count; i += 8) {
+                    __m256i values =
+                        _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)(indices + i)));
+                    __m256i offsets = _mm256_shuffle_epi8(values, octet);
+                    offsets = _mm256_add_epi8(offsets, offsets);
+                    offsets = _mm256_add_epi8(_mm256_add_epi8(offsets, offsets), bytes);
+                    _mm256_storeu_si256((__m256i *)(rgba + i),
+                                        _mm256_shuffle_epi8(lookup, offsets));
+                }
+                _mm256_zeroupper();
+                expand_palette_scalar(indices + i, rgba + i, count - i, palette, colors);
+            }
+#endif
+
+            struct Table {
+                void (*decode_rows)(const u8 *data, u8 *indices, std::size_t rows);
+                void (*apply_palette)(const u8 *indices, u8 *out, std::size_t count, u8 palette);
+                void (*expand_palette)(const u8 *indices, u32 *rgba, std::size_t count,
+                                       u8 palette, const std::array<u32, 4> &colors);
+            };
+
+            // In Kernels order. 128-bit shuffles decode rows no faster than the spread table,
+            // so SSSE3 keeps the scalar decode.
+            constexpr Table tables[] = {
+                {decode_rows_scalar, apply_palette_scalar, expand_palette_scalar},
+#if defined(PIXELS_X86)
+                {decode_rows_scalar, apply_palette_ssse3, expand_palette_ssse3},
+                {decode_rows_avx2, apply_palette_avx2, expand_palette_avx2},
+#endif
+            };
+
+            Kernels detect()
+            {
+#if defined(PIXELS_X86) && defined(_MSC_VER)
+                int info[4];
+                __cpuid(info, 1);
+                bool ssse3 = info[2] & 1 << 9;
+                // AVX2 also needs the OS to save the YMM registers
+                bool ymm = info[2] & 1 << 27 && (_xgetbv(0) & 6) == 6;
+                __cpuidex(info, 7, 0);
+                bool avx2 = ymm && info[1] & 1 << 5;
+#elif defined(PIXELS_X86)
+                __builtin_cpu_init();
+                bool ssse3 = __builtin_cpu_supports("ssse3");
+                bool avx2 = __builtin_cpu_supports("avx2");
+#else
+                bool ssse3 = false;
+                bool avx2 = false;
+#endif
+                return avx2 ? Kernels::Avx2 : ssse3 ? Kernels::Ssse3 : Kernels::Scalar;
+            }
+
+            const Kernels supported = detect();
+            Kernels current = supported;
+        } // namespace
+
+        bool select(Kernels kernels)
+        {
+            if (kernels > supported) {
+                return false;
+            }
+            current = kernels;
+            return true;
+        }
+
+        Kernels selected() { return current; }
+
+        Kernels best() { return supported; }
+
+        const char *name(Kernels kernels)
+        {
+            switch (kernels) {
+                case Kernels::Scalar: return "scalar";
+                case Kernels::Ssse3: return "SSSE3";
+                case Kernels::Avx2: return "AVX2";
+            }
+            return "";
+        }
+
+        void decode_rows(const u8 *data, u8 *indices, std::size_t rows)
+        {
+            tables[(std::size_t)current].decode_rows(data, indices, rows);
+        }
+
+        void apply_palette(const u8 *indices, u8 *shades, std::size_t count, u8 palette)
+        {
+            tables[(std::size_t)current].apply_palette(indices, shades, count, palette);
+        }
+
+        void expand_palette(const u8 *indices, u32 *rgba, std::size_t count, u8 palette,
+                            const std::array<u32, 4> &colors)
+        {
+            tables[(std::size_t)current].expand_palette(indices, rgba, count, palette, colors);
+        }
+    } // namespace Pixels
+} // namespace Gameboy
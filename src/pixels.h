@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+#include <array>
+#include <cstddef>
+
+namespace Gameboy
+{
+    // The PPU's inner loops: tile rows to colour indices, and colour indices through a palette.
+    // Each has a scalar version and, on x86-64, SSSE3 and AVX2 versions; the best one the host
+    // supports is picked at startup.
+    namespace Pixels
+    {
+        enum class Kernels : u8 { Scalar, Ssse3, Avx2 };
+
+        // Kernels the host can't run are refused and the current set is kept
+        bool select(Kernels kernels);
+        Kernels selected();
+        Kernels best();
+        const char *name(Kernels kernels);
+
+        // Rows of two bytes, low bits then high bits, to 8 indices per row, leftmost first
+        void decode_rows(const u8 *data, u8 *indices, std::size_t rows);
+
+        // Indices 0-3 through a BGP/OBP0/OBP1 palette to shades 0-3
+        void apply_palette(const u8 *indices, u8 *shades, std::size_t count, u8 palette);
+
+        // Indices 0-3 through a palette to RGBA, colors holding shades 0-3 as they are stored
+        void expand_palette(const u8 *indices, u32 *rgba, std::size_t count, u8 palette,
+                            const std::array<u32, 4> &colors);
+    } // namespace Pixels
+} // namespace Gameboy
@@ -1,6 +1,334 @@
 #include "ppu.h"
 
+#include "mmu.h"
+#include "pixels.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
 namespace Gameboy
 {
+    namespace
+    {
+        constexpr u8 lines_per_frame = 154;
+
+        constexpr unsigned int line_cycles = 456;
+        // Cycles from the start of a line to the end of each mode, in Mode order. A VBlank
+        // "mode" is one line. The pixel FIFO's mode 3 can run longer, and shorten mode 0.
+        constexpr unsigned int mode_ends[] = {line_cycles, line_cycles, 80, 80 + 172};
+    } // namespace
+
+    PPU::PPU(MMU *memory, Scheduler *scheduler, Renderer renderer)
+        : memory(memory), scheduler(scheduler), drawing(renderer), fifo(memory)
+    {
+        dirty_tiles.set();
+        for (Layer &layer : layers) {
+            layer.dirty.fill(~0u);
+        }
+        scheduler->set_callback(Scheduler::Event::PPU, &PPU::advance, this);
+        memory->set_ppu(this);
+        switch_lcd(memory->peek_io(0x40) & 0x80);
+    }
+
+    PPU::~PPU()
+    {
+        scheduler->cancel(Scheduler::Event::PPU);
+        memory->set_ppu(nullptr);
+    }
+
+    void PPU::switch_lcd(bool on)
+    {
+        if (on == lcd_on) {
+            return;
+        }
+        lcd_on = on;
+        ly = 0;
+        window_line = 0;
+        if (on) {
+            line_start = scheduler->now();
+            enter(Mode::OamScan);
+            return;
+        }
+
+        // The MMU has already reset LY and the mode, the screen goes blank until switched on
+        scheduler->cancel(Scheduler::Event::PPU);
+        mode = Mode::HBlank;
+        stat_line = false;
+        screen.fill(0);
+    }
+
+    void PPU::catch_up()
+    {
+        if (drawing == Renderer::Fifo && mode == Mode::Transfer) {
+            fifo.run(scheduler->now());
+        }
+    }
+
+    void PPU::advance(void *ppu, u64 timestamp) { static_cast<PPU *>(ppu)->next_mode(timestamp); }
+
+    void PPU::next_mode(u64 timestamp)
+    {
+        switch (mode) {
+            case Mode::OamScan:
+                if (drawing == Renderer::Fifo) {
+                    const SpriteLine &sprites = line_sprites();
+                    fifo.start(ly, window_line, timestamp, pixels.data() + ly * width,
+                               sprites.sprites.data(), sprites.count);
+                }
+                enter(Mode::Transfer);
+                break;
+            case Mode::Transfer: end_transfer(timestamp); break;
+            case Mode::HBlank:
+                line_start += line_cycles;
+                if (++ly < height) {
+                    enter(Mode::OamScan);
+                    break;
+                }
+                screen = pixels;
+                frames++;
+                memory->request_interrupt(0);
+                enter(Mode::VBlank);
+                break;
+            case Mode::VBlank:
+                line_start += line_cycles;
+                if (++ly < lines_per_frame) {
+                    enter(Mode::VBlank);
+                    break;
+                }
+                ly = 0;
+                window_line = 0;
+                enter(Mode::OamScan);
+                break;
+        }
+    }
+
+    void PPU::enter(Mode new_mode)
+    {
+        mode = new_mode;
+        update_status();
+        scheduler->schedule(Scheduler::Event::PPU, line_start + mode_ends[(std::size_t)mode]);
+    }
+
+    void PPU::end_transfer(u64 timestamp)
+    {
+        if (drawing == Renderer::Scanline) {
+            render_line();
+            enter(Mode::HBlank);
+            return;
+        }
+
+        // The earliest mode 3 can end was scheduled, look again once the pixels left could
+        // have come out
+        fifo.run(timestamp);
+        if (!fifo.done()) {
+            scheduler->schedule(Scheduler::Event::PPU, timestamp + fifo.remaining());
+            return;
+        }
+        if (fifo.drew_window()) {
+            window_line++;
+        }
+        enter(Mode::HBlank);
+    }
+
+    void PPU::update_status()
+    {
+        bool coincidence = ly == memory->peek_io(0x45);
+        memory->set_lcd_status(ly, (u8)mode, coincidence);
+
+        // One interrupt line ORs every enabled STAT source, it only fires on a rising edge
+        u8 stat = memory->peek_io(0x41);
+        bool line = (stat & 0x40 && coincidence) ||
+                    (mode != Mode::Transfer && stat & 0x08 << (u8)mode);
+        if (line && !stat_line) {
+            memory->request_interrupt(1);
+        }
+        stat_line = line;
+    }
+
+    void PPU::decode_tile(u16 index)
+    {
+        Pixels::decode_rows(memory->video_ram() + index * 16, tiles[index].data(), 8);
+        dirty_tiles.reset(index);
+    }
+
+    void PPU::render_line()
+    {
+        // Colour indices before the palette
+        std::array<u8, width> line;
+        u8 lcdc = memory->peek_io(0x40);
+        bool signed_tiles = !(lcdc & 0x10);
+        if (lcdc & 0x01) {
+            u8 scx = memory->peek_io(0x43);
+            u8 scy = memory->peek_io(0x42);
+            copy_layer(line.data(), 0, lcdc & 0x08 ? 1 : 0, scx, (u8)(scy + ly), signed_tiles);
+
+            // WX is the window's left edge plus 7, below that its first columns are cut off
+            u8 wy = memory->peek_io(0x4A);
+            u8 wx = memory->peek_io(0x4B);
+            if (lcdc & 0x20 && ly >= wy && wx < width + 7) {
+                unsigned int x = wx < 7 ? 0 : wx - 7;
+                copy_layer(line.data(), x, lcdc & 0x40 ? 1 : 0, x + 7 - wx, window_line,
+                           signed_tiles);
+                window_line++;
+            }
+        } else {
+            line.fill(0);
+        }
+
+        Pixels::apply_palette(line.data(), pixels.data() + ly * width, width,
+                              memory->peek_io(0x47));
+
+        if (lcdc & 0x02) {
+            render_sprites(line.data());
+        }
+    }
+
+    void PPU::copy_layer(u8 *line, unsigned int x, u8 map, u8 map_x, u8 map_y,
+                         bool signed_tiles)
+    {
+        // Wrapping around the right edge of the map back to its left
+        const u8 *row = layer_row(map, map_y, signed_tiles);
+        unsigned int count = width - x;
+        unsigned int first = std::min(count, 256u - map_x);
+        std::memcpy(line + x, row + map_x, first);
+        std::memcpy(line + x + first, row, count - first);
+    }
+
+    const u8 *PPU::layer_row(u8 map, u8 y, bool signed_tiles)
+    {
+        if (changed_tiles.any()) {
+            mark_changed_tiles();
+        }
+        Layer &layer = layers[map];
+        if (layer.signed_tiles != signed_tiles) {
+            layer.signed_tiles = signed_tiles;
+            layer.dirty.fill(~0u);
+        }
+
+        u8 *block = layer.pixels.data() + y / 8 * 8 * 256;
+        const u8 *entries = memory->video_ram() + 0x1800 + map * 0x400 + y / 8 * 32;
+        for (u32 &dirty = layer.dirty[y / 8]; dirty; dirty &= dirty - 1) {
+            unsigned int column = std::countr_zero(dirty);
+            u16 number = signed_tiles ? 256 + (i8)entries[column] : entries[column];
+            const Tile &decoded = tile(number);
+            for (unsigned int row = 0; row < 8; row++) {
+                std::memcpy(block + row * 256 + column * 8, decoded.data() + row * 8, 8);
+            }
+        }
+        return layer.pixels.data() + y * 256;
+    }
+
+    void PPU::mark_changed_tiles()
+    {
+        // Every entry showing a changed tile, under the tile numbering its layer was drawn with
+        const u8 *entries = memory->video_ram() + 0x1800;
+        for (u8 map = 0; map < layers.size(); map++) {
+            Layer &layer = layers[map];
+            for (unsigned int entry = 0; entry < 0x400; entry++) {
+                u8 index = entries[map * 0x400 + entry];
+                u16 number = layer.signed_tiles ? 256 + (i8)index : index;
+                if (changed_tiles[number]) {
+                    layer.dirty[entry >> 5] |= 1u << (entry & 31);
+                }
+            }
+        }
+        changed_tiles.reset();
+    }
+
+    void PPU::render_sprites(const u8 *background)
+    {
+        // A pixel goes to the first sprite that is opaque there even if that sprite is then
+        // hidden behind the background
+        const SpriteLine &line = line_sprites();
+        const u8 *oam = memory->object_attributes();
+        std::array<bool, width> taken = {};
+        u8 *out = pixels.data() + ly * width;
+        for (unsigned int drawn = 0; drawn < line.count; drawn++) {
+            const u8 *sprite = oam + line.sprites[drawn] * 4;
+            u8 flags = sprite[3];
+            unsigned int row = ly + 16 - sprite[0];
+            if (flags & 0x40) {
+                row = sprite_height - 1 - row;
+            }
+            u16 number = sprite_height == 16 ? (sprite[2] & 0xFE) + row / 8 : sprite[2];
+            const u8 *colors = tile(number).data() + row % 8 * 8;
+            u8 palette = memory->peek_io(flags & 0x10 ? 0x49 : 0x48);
+
+            for (unsigned int column = 0; column < 8; column++) {
+                int x = sprite[1] - 8 + (int)column;
+                u8 color = colors[flags & 0x20 ? 7 - column : column];
+                if (x < 0 || x >= (int)width || !color || taken[x]) {
+                    continue;
+                }
+                taken[x] = true;
+                if (!(flags & 0x80) || !background[x]) {
+                    out[x] = palette >> color * 2 & 3;
+                }
+            }
+        }
+    }
+
+    const PPU::SpriteLine &PPU::line_sprites()
+    {
+        const u8 *oam = memory->object_attributes();
+        update_sprite_masks(oam);
+
+        SpriteLine &line = sprite_lines[ly];
+        if (!unsorted_lines[ly]) {
+            return line;
+        }
+        unsorted_lines.reset(ly);
+
+        // Insertion by X as they come in OAM order keeps ties in OAM order
+        line.count = 0;
+        for (u64 mask = sprite_masks[ly]; mask && line.count < sprites_per_line;
+             mask &= mask - 1) {
+            u8 sprite = (u8)std::countr_zero(mask);
+            u8 x = oam[sprite * 4 + 1];
+            unsigned int slot = line.count++;
+            for (; slot > 0 && oam[line.sprites[slot - 1] * 4 + 1] > x; slot--) {
+                line.sprites[slot] = line.sprites[slot - 1];
+            }
+            line.sprites[slot] = sprite;
+        }
+        return line;
+    }
+
+    void PPU::update_sprite_masks(const u8 *oam)
+    {
+        // A new sprite size moves every sprite, so start over
+        u8 new_height = memory->peek_io(0x40) & 0x04 ? 16 : 8;
+        if (new_height != sprite_height) {
+            sprite_height = new_height;
+            sprite_masks.fill(0);
+            unsorted_lines.set();
+            for (u8 sprite = 0; sprite < sprite_count; sprite++) {
+                sprite_tops[sprite] = oam[sprite * 4];
+                place_sprite(sprite, true);
+            }
+            dirty_sprites = 0;
+        }
+
+        for (; dirty_sprites; dirty_sprites &= dirty_sprites - 1) {
+            u8 sprite = (u8)std::countr_zero(dirty_sprites);
+            place_sprite(sprite, false);
+            sprite_tops[sprite] = oam[sprite * 4];
+            place_sprite(sprite, true);
+        }
+    }
 
-}
\ No newline at end of file
+    void PPU::place_sprite(u8 sprite, bool covers)
+    {
+        // OAM holds a sprite's top line plus 16
+        int top = sprite_tops[sprite] - 16;
+        int first = std::max(top, 0);
+        int end = std::min(top + (int)sprite_height, (int)height);
+        u64 bit = 1ull << sprite;
+        for (int line = first; line < end; line++) {
+            sprite_masks[line] = covers ? sprite_masks[line] | bit : sprite_masks[line] & ~bit;
+            unsorted_lines.set(line);
+        }
+    }
+} // namespace Gameboy
@@ -1,9 +1,149 @@
 #pragma once
 
+#include "pixel_fifo.h"
+#include "types.h"
+
+#include <array>
+#include <bitset>
+
 namespace Gameboy
 {
+    class MMU;
+    class Scheduler;
+
+    // Runs the LCD's modes on the scheduler and draws mode 3 with one of two renderers, chosen
+    // when the PPU is made.
+    //
+    // Scanline renders a line at a time, at the end of its mode 3. Tiles are kept decoded to one
+    // colour index per byte, and both tile maps are kept drawn out in full from them, so the
+    // background and window of a line are wrapped copies out of a map that are then looked up
+    // in a palette. The MMU invalidates a tile or map entry when its VRAM is written. Mode 3
+    // always takes 172 cycles.
+    //
+    // Fifo runs the pixel FIFO a dot at a time, catching up whenever an LCD register is about to
+    // change. Mode 3 takes as long as the fetcher needs, and mid-line register writes land on
+    // the pixel they would on hardware. With registers left alone during a line both draw the
+    // same pixels.
     class PPU
     {
-    
+      public:
+        enum class Renderer : u8 { Scanline, Fifo };
+
+        static constexpr unsigned int width = 160;
+        static constexpr unsigned int height = 144;
+        typedef std::array<u8, width * height> Frame;
+
+        PPU(MMU *memory, Scheduler *scheduler, Renderer renderer = Renderer::Scanline);
+        ~PPU();
+        PPU(const PPU &) = delete;
+        PPU &operator=(const PPU &) = delete;
+
+        // Shades 0-3, lightest first, of the last completed frame
+        const Frame &frame() const { return screen; }
+        u64 frame_count() const { return frames; }
+        Renderer renderer() const { return drawing; }
+
+        // Called by the MMU
+        void invalidate_tile(u16 tile)
+        {
+            dirty_tiles.set(tile);
+            changed_tiles.set(tile);
+        }
+        // Entries of both maps in a row, 0x9800 onwards
+        void invalidate_map_entry(u16 entry)
+        {
+            layers[entry >> 10].dirty[entry >> 5 & 31] |= 1u << (entry & 31);
+        }
+        // When the Y or X of sprites first to last may have changed
+        void invalidate_sprites(u8 first, u8 last)
+        {
+            dirty_sprites |= ((2ull << last) - 1) & ~((1ull << first) - 1);
+        }
+        void switch_lcd(bool on);
+        // Before a write to a register that changes how pixels come out
+        void catch_up();
+
+      private:
+        enum class Mode : u8 { HBlank, VBlank, OamScan, Transfer };
+
+        static constexpr unsigned int tile_count = 384;
+        typedef std::array<u8, 64> Tile;
+
+        // A tile map drawn out as 256x256 colour indices. Entries whose index or tile changed
+        // are drawn again a row of entries at a time, once a line needs that row.
+        struct Layer {
+            std::array<u8, 256 * 256> pixels;
+            // A bit per entry, a word per row of entries
+            std::array<u32, 32> dirty;
+            bool signed_tiles = false;
+        };
+
+        static constexpr unsigned int sprite_count = 40;
+        static constexpr unsigned int sprites_per_line = 10;
+        // The first 10 sprites in OAM that cover a line, lower X first then the earlier entry
+        struct SpriteLine {
+            std::array<u8, sprites_per_line> sprites;
+            u8 count;
+        };
+
+        static void advance(void *ppu, u64 timestamp);
+        void next_mode(u64 timestamp);
+        void enter(Mode mode);
+        void end_transfer(u64 timestamp);
+        void update_status();
+
+        const Tile &tile(u16 index)
+        {
+            if (dirty_tiles[index]) {
+                decode_tile(index);
+            }
+            return tiles[index];
+        }
+        void decode_tile(u16 index);
+        void render_line();
+        void copy_layer(u8 *line, unsigned int x, u8 map, u8 map_x, u8 map_y, bool signed_tiles);
+        const u8 *layer_row(u8 map, u8 y, bool signed_tiles);
+        void mark_changed_tiles();
+        void render_sprites(const u8 *background);
+        const SpriteLine &line_sprites();
+        void update_sprite_masks(const u8 *oam);
+        void place_sprite(u8 sprite, bool covers);
+
+      private:
+        MMU *memory;
+        Scheduler *scheduler;
+
+        Renderer drawing;
+        PixelFifo fifo;
+
+        Mode mode = Mode::HBlank;
+        u64 line_start = 0;
+        u8 ly = 0;
+        // The window has its own line counter, it only advances on lines that draw it
+        u8 window_line = 0;
+        bool lcd_on = false;
+        bool stat_line = false;
+
+        std::array<Tile, tile_count> tiles;
+        std::bitset<tile_count> dirty_tiles;
+
+        // For 0x9800 and 0x9C00, and the tiles changed since the layers last looked
+        std::array<Layer, 2> layers;
+        std::bitset<tile_count> changed_tiles;
+
+        // Which sprites cover each line. A sprite whose Y or X changes is taken off the lines
+        // it was on and put on its new ones, and only those lines are sorted again.
+        std::array<u64, height> sprite_masks = {};
+        std::array<SpriteLine, height> sprite_lines = {};
+        std::bitset<height> unsorted_lines;
+        // Each sprite's Y as it is placed in sprite_masks
+        std::array<u8, sprite_count> sprite_tops = {};
+        u64 dirty_sprites = 0;
+        // 0 until the first placement, then 8 or 16
+        u8 sprite_height = 0;
+
+        Frame pixels = {};
+        Frame screen = {};
+        u64 frames = 0;
     };
-}
\ No newline at end of file
+} // namespace Gameboy
@@ -0,0 +1,135 @@
+#include "rtc.h"
+
+#include <chrono>
+
+namespace Gameboy
+{
+    namespace
+    {
+        i64 now()
+        {
+            return std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                .count();
+        }
+
+        u64 load_le(const u8 *bytes, int count)
+        {
+            u64 value = 0;
+            for (int i = count - 1; i >= 0; i--) {
+                value = value << 8 | bytes[i];
+            }
+            return value;
+        }
+
+        void store_le(u8 *bytes, u64 value, int count)
+        {
+            for (int i = 0; i < count; i++) {
+                bytes[i] = (u8)(value >> 8 * i);
+            }
+        }
+    } // namespace
+
+    RealTimeClock::RealTimeClock() : base(now()) {}
+
+    i64 RealTimeClock::counter() const { return halted ? halted_counter : now() - base; }
+
+    void RealTimeClock::set_counter(i64 seconds)
+    {
+        if (halted) {
+            halted_counter = seconds;
+        } else {
+            base = now() - seconds;
+        }
+    }
+
+    std::array<u8, 5> RealTimeClock::registers()
+    {
+        // The day counter is 9 bits, overflowing sets the carry until software clears it
+        i64 seconds = counter();
+        if (seconds >= days * seconds_per_day) {
+            carry = true;
+            seconds %= days * seconds_per_day;
+            set_counter(seconds);
+        }
+        i64 day = seconds / seconds_per_day;
+        return {
+            (u8)(seconds % 60),
+            (u8)(seconds / 60 % 60),
+            (u8)(seconds / 3600 % 24),
+            (u8)day,
+            (u8)(day >> 8 | halted << 6 | carry << 7),
+        };
+    }
+
+    void RealTimeClock::latch()
+    {
+        latched = registers();
+        store();
+    }
+
+    void RealTimeClock::load(const u8 *state)
+    {
+        // A state that was never stored, the clock starts from zero
+        i64 timestamp = (i64)load_le(state + 40, 8);
+        if (timestamp == 0) {
+            return;
+        }
+
+        std::array<u8, 5> saved;
+        for (std::size_t i = 0; i < saved.size(); i++) {
+            saved[i] = (u8)load_le(state + 4 * i, 4);
+            latched[i] = (u8)load_le(state + 20 + 4 * i, 4);
+        }
+        halted = saved[4] & 0x40;
+        carry = saved[4] & 0x80;
+
+        // The clock kept running while the emulator was closed
+        i64 day = saved[3] | (saved[4] & 1) << 8;
+        i64 seconds = saved[0] + saved[1] * 60 + saved[2] * 3600 + day * seconds_per_day;
+        if (!halted && now() > timestamp) {
+            seconds += now() - timestamp;
+        }
+        set_counter(seconds);
+    }
+
+    void RealTimeClock::persist(u8 *state)
+    {
+        stored = state;
+        store();
+    }
+
+    void RealTimeClock::store()
+    {
+        if (!stored) {
+            return;
+        }
+        std::array<u8, 5> current = registers();
+        for (std::size_t i = 0; i < current.size(); i++) {
+            store_le(stored + 4 * i, current[i], 4);
+            store_le(stored + 20 + 4 * i, latched[i], 4);
+        }
+        store_le(stored + 40, (u64)now(), 8);
+    }
+
+    void RealTimeClock::write(u8 reg, u8 value)
+    {
+        std::array<u8, 5> current = registers();
+        current[reg - 0x08] = value;
+
+        if (reg == 0x0C) {
+            carry = value & 0x80;
+            bool halt = value & 0x40;
+            if (halt != halted) {
+                // Freeze or restart the counter where it stands
+                i64 seconds = counter();
+                halted = halt;
+                set_counter(seconds);
+            }
+        }
+
+        i64 day = current[3] | (current[4] & 1) << 8;
+        set_counter(current[0] + current[1] * 60 + current[2] * 3600 + day * seconds_per_day);
+        store();
+    }
+} // namespace Gameboy
\ No newline at end of file
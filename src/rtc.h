@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.h"
+
+#include <array>
+#include <cstddef>
+
+namespace Gameboy
+{
+    // The MBC3 real time clock. It counts host wall-clock seconds, so it keeps running while
+    // the emulator is closed as long as its state is saved with the cartridge RAM.
+    class RealTimeClock
+    {
+      public:
+        RealTimeClock();
+
+        // Registers 0x08-0x0C: seconds, minutes, hours, day bits 0-7, and day bit 8 with halt
+        // (bit 6) and day carry (bit 7). Reads return the last latched time.
+        u8 read(u8 reg) const { return latched[reg - 0x08]; }
+        void write(u8 reg, u8 value);
+        void latch();
+
+        // The 48 bytes most emulators append to a .sav file: the current and latched registers
+        // as 32-bit words, then the Unix time they were stored at
+        static constexpr std::size_t state_size = 48;
+        void load(const u8 *state);
+        // Keeps state up to date from now on, it only changes when the game writes or latches
+        void persist(u8 *state);
+
+      private:
+        // Seconds since day 0, 00:00:00
+        i64 counter() const;
+        void set_counter(i64 seconds);
+        std::array<u8, 5> registers();
+        void store();
+
+      private:
+        static constexpr i64 seconds_per_day = 24 * 60 * 60;
+        static constexpr i64 days = 512;
+
+        // Host time at which the counter was zero, or the frozen counter while halted
+        i64 base;
+        i64 halted_counter = 0;
+        bool halted = false;
+        bool carry = false;
+        std::array<u8, 5> latched = {};
+        u8 *stored = nullptr;
+    };
+} // namespace Gameboy
\ No newline at end of file
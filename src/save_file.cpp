@@ -0,0 +1,100 @@
+#include "save_file.h"
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Gameboy
+{
+    SaveFile::SaveFile(const std::string &path, std::size_t size) : length(size)
+    {
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(
+            path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        LARGE_INTEGER file_size = {};
+        GetFileSizeEx(file, &file_size);
+        grown = (std::size_t)file_size.QuadPart < size;
+        // Mapping a view larger than the file extends it with zeroes
+        HANDLE mapping = CreateFileMappingA(
+            file, nullptr, PAGE_READWRITE, (DWORD)((u64)size >> 32), (DWORD)size, nullptr);
+        CloseHandle(file);
+        if (mapping) {
+            memory = (u8 *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+            CloseHandle(mapping);
+        }
+        if (!memory) {
+            throw std::runtime_error("cannot map " + path);
+        }
+#else
+        int file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat status;
+        void *mapping = MAP_FAILED;
+        if (fstat(file, &status) == 0) {
+            grown = (std::size_t)status.st_size < size;
+            if (!grown || ftruncate(file, (off_t)size) == 0) {
+                mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            }
+        }
+        close(file);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path);
+        }
+        memory = (u8 *)mapping;
+#endif
+
+        flusher = std::thread(&SaveFile::flush_loop, this);
+    }
+
+    SaveFile::~SaveFile()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        wake.notify_one();
+        flusher.join();
+
+#if defined(_WIN32)
+        UnmapViewOfFile(memory);
+#else
+        munmap(memory, length);
+#endif
+    }
+
+    void SaveFile::flush_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, flush_interval, [this] { return closing; })) {
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+        lock.unlock();
+        flush();
+    }
+
+    void SaveFile::flush()
+    {
+        // Only pages written since the last flush go to disk. This blocks until they are
+        // written, which is why it runs on the flush thread.
+#if defined(_WIN32)
+        FlushViewOfFile(memory, length);
+#else
+        msync(memory, length, MS_SYNC);
+#endif
+    }
+} // namespace Gameboy
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "types.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Gameboy
+{
+    // Battery-backed cartridge RAM, kept in a file mapped shared so every write lands in the
+    // page cache as it happens. A background thread msyncs the mapping every flush_interval
+    // and once more on close; the emulation thread never does file I/O itself.
+    //
+    // Crash consistency: if the emulator crashes or is killed, nothing is lost, the kernel
+    // still holds the dirty pages and writes them back. If the machine itself goes down, up
+    // to flush_interval of writes can be lost, and since cartridge RAM has no commit point a
+    // save spread over several pages can come back torn, some pages old and some new.
+    // Throws std::runtime_error if the file cannot be created or mapped.
+    class SaveFile
+    {
+      public:
+        static constexpr std::chrono::milliseconds flush_interval{1000};
+
+        SaveFile(const std::string &path, std::size_t size);
+        ~SaveFile();
+        SaveFile(const SaveFile &) = delete;
+        SaveFile &operator=(const SaveFile &) = delete;
+
+        u8 *data() const { return memory; }
+        std::size_t size() const { return length; }
+
+        // Whether the file was shorter than size, the missing part reads as zero
+        bool extended() const { return grown; }
+
+      private:
+        void flush_loop();
+        void flush();
+
+      private:
+        u8 *memory = nullptr;
+        std::size_t length = 0;
+        bool grown = false;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool closing = false;
+        std::thread flusher;
+    };
+} // namespace Gameboy
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "scheduler.h"
+
+namespace Gameboy
+{
+    Scheduler::Scheduler() { position.fill(unscheduled); }
+
+    void Scheduler::set_callback(Event event, Callback callback, void *component)
+    {
+        handlers[(std::size_t)event] = {callback, component};
+    }
+
+    void Scheduler::schedule(Event event, u64 at)
+    {
+        u8 index = position[(std::size_t)event];
+        if (index == unscheduled) {
+            index = size++;
+        }
+        place(index, {at, event});
+        sift_up(index);
+        sift_down(position[(std::size_t)event]);
+
+        // Scheduled from inside a run, e.g. by an IO write, so stop the CPU earlier
+        if (at < deadline) {
+            deadline = at;
+        }
+    }
+
+    void Scheduler::cancel(Event event)
+    {
+        u8 index = position[(std::size_t)event];
+        if (index != unscheduled) {
+            remove(index);
+        }
+    }
+
+    void Scheduler::dispatch()
+    {
+        while (size && heap[0].at <= timestamp) {
+            Entry entry = heap[0];
+            remove(0);
+
+            // The callback may schedule its next event straight away
+            const Handler &handler = handlers[(std::size_t)entry.event];
+            if (handler.callback) {
+                handler.callback(handler.component, entry.at);
+            }
+        }
+    }
+
+    void Scheduler::remove(u8 index)
+    {
+        position[(std::size_t)heap[index].event] = unscheduled;
+        size--;
+        if (index == size) {
+            return;
+        }
+        Event moved = heap[size].event;
+        place(index, heap[size]);
+        sift_up(index);
+        sift_down(position[(std::size_t)moved]);
+    }
+
+    void Scheduler::sift_up(u8 index)
+    {
+        Entry entry = heap[index];
+        while (index > 0) {
+            u8 parent = (index - 1) / 2;
+            if (heap[parent].at <= entry.at) {
+                break;
+            }
+            place(index, heap[parent]);
+            index = parent;
+        }
+        place(index, entry);
+    }
+
+    void Scheduler::sift_down(u8 index)
+    {
+        Entry entry = heap[index];
+        while (true) {
+            u8 child = index * 2 + 1;
+            if (child >= size) {
+                break;
+            }
+            if (child + 1 < size && heap[child + 1].at < heap[child].at) {
+                child++;
+            }
+            if (entry.at <= heap[child].at) {
+                break;
+            }
+            place(index, heap[child]);
+            index = child;
+        }
+        place(index, entry);
+    }
+
+    void Scheduler::place(u8 index, const Entry &entry)
+    {
+        heap[index] = entry;
+        position[(std::size_t)entry.event] = index;
+    }
+} // namespace Gameboy
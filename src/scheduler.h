@@ -0,0 +1,81 @@
+#pragma once
+
+#include "types.h"
+
+#include <array>
+
+namespace Gameboy
+{
+    // Cycle-timestamped events for everything clocked alongside the CPU. Each component keeps
+    // at most one pending event, the CPU runs uninterrupted up to the earliest of them and the
+    // due callbacks run in timestamp order afterwards.
+    class Scheduler
+    {
+      public:
+        enum class Event : u8 { PPU, Timer, Divider, Audio, Serial, DMA, Count };
+
+        typedef void (*Callback)(void *component, u64 timestamp);
+
+        Scheduler();
+
+        u64 now() const { return timestamp; }
+
+        void set_callback(Event event, Callback callback, void *component);
+        void schedule(Event event, u64 at);
+        void schedule_in(Event event, u64 cycles) { schedule(event, timestamp + cycles); }
+        void cancel(Event event);
+
+        // Ends the current run after the step in progress, e.g. from a debugger trap
+        void stop()
+        {
+            deadline = timestamp;
+            stopping = true;
+        }
+
+        // Runs the CPU and due events until the given time
+        template <typename Core> void run(Core &cpu, u64 until)
+        {
+            stopping = false;
+            while (timestamp < until && !stopping) {
+                deadline = size && heap[0].at < until ? heap[0].at : until;
+                while (timestamp < deadline) {
+                    u64 cycles = deadline - timestamp;
+                    timestamp += cpu.step(cycles < max_step ? (unsigned int)cycles : max_step);
+                }
+                dispatch();
+            }
+        }
+
+      private:
+        struct Entry {
+            u64 at;
+            Event event;
+        };
+
+        struct Handler {
+            Callback callback;
+            void *component;
+        };
+
+        static constexpr std::size_t event_count = (std::size_t)Event::Count;
+        static constexpr u8 unscheduled = 0xFF;
+        static constexpr unsigned int max_step = 0x10000000;
+
+        void dispatch();
+        void remove(u8 index);
+        void sift_up(u8 index);
+        void sift_down(u8 index);
+        void place(u8 index, const Entry &entry);
+
+      private:
+        u64 timestamp = 0;
+        u64 deadline = 0;
+        bool stopping = false;
+
+        // Binary min-heap on timestamp, with each event's heap slot for rescheduling
+        std::array<Entry, event_count> heap;
+        std::array<u8, event_count> position;
+        std::array<Handler, event_count> handlers = {};
+        u8 size = 0;
+    };
+} // namespace Gameboy
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+#include <cstdio>
+
+namespace Gameboy
+{
+    class CodeCache;
+
+    // Forwards to another bus and writes every access to a trace file. Opcode bytes are
+    // traced when their block is decoded, not each time it runs.
+    template <typename Bus> class TracingBus
+    {
+      public:
+        TracingBus(Bus *bus, std::FILE *trace) : bus(bus), trace(trace) {}
+
+        u8 read(u16 address) const
+        {
+            u8 value = bus->read(address);
+            std::fprintf(trace, "R %04X %02X\n", address, value);
+            return value;
+        }
+        u8 read_io(u8 offset) const
+        {
+            u8 value = bus->read_io(offset);
+            std::fprintf(trace, "R %04X %02X\n", 0xFF00 + offset, value);
+            return value;
+        }
+
+        void write(u16 address, u8 value)
+        {
+            std::fprintf(trace, "W %04X %02X\n", address, value);
+            bus->write(address, value);
+        }
+        void write_io(u8 offset, u8 value)
+        {
+            std::fprintf(trace, "W %04X %02X\n", 0xFF00 + offset, value);
+            bus->write_io(offset, value);
+        }
+
+        u8 pending_interrupts() const { return bus->pending_interrupts(); }
+        void request_interrupt(u8 interrupt)
+        {
+            std::fprintf(trace, "I %u\n", interrupt);
+            bus->request_interrupt(interrupt);
+        }
+
+        u16 rom_bank() const { return bus->rom_bank(); }
+
+        void set_decode_cache(CodeCache *cache) { bus->set_decode_cache(cache); }
+        void mark_code_page(u8 page) { bus->mark_code_page(page); }
+        bool dma_active() const { return bus->dma_active(); }
+
+        // Bulk transfers would bypass the trace, so every access goes through read/write
+        const u8 *read_span(u16, u16) const { return nullptr; }
+        u8 *write_span(u16, u16) { return nullptr; }
+
+      private:
+        Bus *bus;
+        std::FILE *trace;
+    };
+} // namespace Gameboy
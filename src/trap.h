@@ -0,0 +1,21 @@
+#pragma once
+
+#include "types.h"
+
+namespace Gameboy
+{
+    // A breakpoint or watchpoint that was hit
+    struct Trap {
+        enum class Kind : u8 { Execute, Read, Write };
+
+        Kind kind;
+        u16 address;
+        // The opcode at a breakpoint, or the byte read or about to be written
+        u8 value;
+    };
+
+    // Called as a trap is hit. A breakpoint stops the CPU in front of its instruction for one
+    // step, a watchpoint reports from inside the access; either way the handler can end the
+    // current Scheduler::run() with stop().
+    typedef void (*TrapHandler)(void *context, const Trap &trap);
+} // namespace Gameboy